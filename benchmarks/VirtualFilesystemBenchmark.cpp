@@ -0,0 +1,393 @@
+#include "commands/command.hpp"
+#include "core/history.hpp"
+#include "core/parser.hpp"
+#include "core/virtual_filesystem.hpp"
+#include "git_revision.hpp"
+#include <archive.h>
+#include <archive_entry.h>
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <malloc.h>
+#include <unistd.h>
+#endif
+
+// Synthetic images are deterministic so results are comparable across
+// commits. Shapes:
+//   wide - every file is a child of /w;
+//   deep - chains of kDeepLevels nested directories, each holding
+//          kDeepFilesPerDir files, so paths are kDeepLevels segments long.
+enum Shape { WIDE, DEEP };
+
+constexpr int64_t kSizes[] = {1000, 100000, 1000000};
+constexpr int64_t kTraversalSizes[] = {1000, 100000};
+constexpr int64_t kHistorySizes[] = {10000, 100000, 500000};
+constexpr int kDeepLevels = 64;
+constexpr int kDeepFilesPerDir = 15;
+
+const char *shapeName(Shape shape) { return shape == WIDE ? "wide" : "deep"; }
+
+class ImageWriter {
+public:
+  explicit ImageWriter(const std::string &path) {
+    writer = archive_write_new();
+    archive_write_set_format_pax_restricted(writer);
+    if (archive_write_open_filename(writer, path.c_str()) != ARCHIVE_OK) {
+      archive_write_free(writer);
+      throw std::runtime_error("Failed to create image: " + path);
+    }
+    entry = archive_entry_new();
+  }
+
+  ~ImageWriter() {
+    archive_entry_free(entry);
+    archive_write_close(writer);
+    archive_write_free(writer);
+  }
+
+  void add(const std::string &path, FileType fileType) {
+    archive_entry_clear(entry);
+    archive_entry_set_pathname(entry, path.c_str());
+    archive_entry_set_size(entry, 0);
+    archive_entry_set_filetype(entry,
+                               fileType == FileType::DIR ? AE_IFDIR : AE_IFREG);
+    archive_entry_set_perm(entry, 0755);
+    archive_write_header(writer, entry);
+  }
+
+private:
+  struct archive *writer;
+  struct archive_entry *entry;
+};
+
+// Path of a directory that every shape has, with files directly below it.
+std::string sampleDirectory(Shape shape) {
+  if (shape == WIDE) {
+    return "/w";
+  }
+  std::string path = "/c0";
+  for (int level = 1; level < kDeepLevels / 2; ++level) {
+    path += "/d" + std::to_string(level);
+  }
+  return path;
+}
+
+std::string imagePath(Shape shape, int64_t entries) {
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() / "cpp-terminal-bench";
+  std::filesystem::create_directories(directory);
+  std::string path = (directory / (std::string(shapeName(shape)) + "-" +
+                                   std::to_string(entries) + ".tar"))
+                         .string();
+  if (std::filesystem::exists(path)) {
+    return path;
+  }
+
+  std::string partialPath = path + ".partial";
+  {
+    ImageWriter image(partialPath);
+    if (shape == WIDE) {
+      image.add("/w", FileType::DIR);
+      for (int64_t i = 1; i < entries; ++i) {
+        image.add("/w/f" + std::to_string(i), FileType::REG);
+      }
+    } else {
+      int64_t written = 0;
+      for (int64_t chain = 0; written < entries; ++chain) {
+        std::string directory = "/c" + std::to_string(chain);
+        for (int level = 1; level <= kDeepLevels && written < entries;
+             ++level) {
+          image.add(directory, FileType::DIR);
+          ++written;
+          for (int i = 0; i < kDeepFilesPerDir && written < entries; ++i) {
+            image.add(directory + "/f" + std::to_string(i), FileType::REG);
+            ++written;
+          }
+          directory += "/d" + std::to_string(level);
+        }
+      }
+    }
+  }
+  std::filesystem::rename(partialPath, path);
+  return path;
+}
+
+// A history file of `lines` commands of the kinds a shell session issues.
+std::string historyPath(int64_t lines) {
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() / "cpp-terminal-bench";
+  std::filesystem::create_directories(directory);
+  std::string path =
+      (directory / ("history-" + std::to_string(lines) + ".txt")).string();
+  if (std::filesystem::exists(path)) {
+    return path;
+  }
+
+  std::string partialPath = path + ".partial";
+  {
+    std::ofstream history(partialPath, std::ios::trunc);
+    for (int64_t i = 0; i < lines; ++i) {
+      switch (i % 4) {
+      case 0:
+        history << "ls /w/f" << i << "\n";
+        break;
+      case 1:
+        history << "cd /c" << i % 100 << "/d" << i % kDeepLevels << "\n";
+        break;
+      case 2:
+        history << "cp /w/f" << i << " /copy" << i << "\n";
+        break;
+      default:
+        history << "tree /c" << i % 7 << "\n";
+      }
+    }
+  }
+  std::filesystem::rename(partialPath, path);
+  return path;
+}
+
+// Mounts a private copy of the image so mutating benchmarks never change the
+// cached one.
+std::shared_ptr<VirtualFilesystem> mountCopy(Shape shape, int64_t entries) {
+  std::string source = imagePath(shape, entries);
+  std::string copy = source + ".scratch";
+  std::filesystem::copy_file(source, copy,
+                             std::filesystem::copy_options::overwrite_existing);
+  return std::shared_ptr<VirtualFilesystem>(
+      new VirtualFilesystem(copy), [copy](VirtualFilesystem *vfs) {
+        delete vfs;
+        std::filesystem::remove(copy);
+      });
+}
+
+// Resident set size right now. The peak (ru_maxrss) only ever grows over the
+// process, so it would charge every benchmark for the largest image mounted
+// before it; each benchmark reports how far its own setup and loop moved
+// this instead.
+double residentKilobytes() {
+#ifdef __GLIBC__
+  // Hand memory freed by earlier runs back, or it stays resident and hides
+  // what this run allocates.
+  malloc_trim(0);
+#endif
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.WorkingSetSize / 1024.0;
+#elif defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+            reinterpret_cast<task_info_t>(&info), &count);
+  return info.resident_size / 1024.0;
+#else
+  // statm reports pages: total program size, then resident.
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+#endif
+}
+
+void finish(benchmark::State &state, int64_t itemsPerIteration,
+            double residentBefore) {
+  state.SetItemsProcessed(state.iterations() * itemsPerIteration);
+  state.counters["rss_delta_kb"] = residentKilobytes() - residentBefore;
+}
+
+void BM_Mount(benchmark::State &state, Shape shape) {
+  std::string path = imagePath(shape, state.range(0));
+  double residentBefore = residentKilobytes();
+  // The last mount stays alive until its footprint is measured.
+  std::unique_ptr<VirtualFilesystem> vfs;
+  for (auto _ : state) {
+    vfs.reset();
+    vfs = std::make_unique<VirtualFilesystem>(path);
+    benchmark::DoNotOptimize(vfs->existsInStorage("/"));
+  }
+  finish(state, state.range(0), residentBefore);
+}
+
+void BM_NormalizePath(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  std::string directory = sampleDirectory(shape);
+  vfs->changeDirectory(directory);
+  const std::string relative = "./f1/../../" +
+                               directory.substr(directory.rfind('/') + 1) +
+                               "/./f2";
+  for (auto _ : state) {
+    bool isDirectory = false;
+    benchmark::DoNotOptimize(vfs->normalizePath(directory + "/f1", isDirectory));
+    benchmark::DoNotOptimize(vfs->normalizePath(relative, isDirectory));
+  }
+  finish(state, 2, residentBefore);
+}
+
+void BM_ListDirectory(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  std::string directory = sampleDirectory(shape);
+  size_t listed = 0;
+  for (auto _ : state) {
+    std::string errorMessage;
+    auto files = vfs->listDirectory(directory, errorMessage);
+    listed = files.size();
+    benchmark::DoNotOptimize(files);
+  }
+  finish(state, listed, residentBefore);
+}
+
+void BM_Complete(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  Parser parser(vfs);
+  const std::string input = "ls " + sampleDirectory(shape) + "/f1";
+  std::vector<std::string> candidates;
+  // The first lookup materializes the directory; time the lookups after it.
+  parser.complete(input, candidates);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(parser.complete(input, candidates));
+  }
+  finish(state, 1, residentBefore);
+}
+
+void BM_Tree(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  TreeCommand treeCommand(vfs);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(treeCommand.execute({"/"}));
+  }
+  finish(state, state.range(0), residentBefore);
+}
+
+void BM_Find(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  FindCommand findCommand(vfs);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(findCommand.execute({"f1"}));
+  }
+  finish(state, state.range(0), residentBefore);
+}
+
+void BM_Cp(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  CpCommand cpCommand(vfs);
+  std::string source = sampleDirectory(shape) + "/f1";
+  int64_t copies = 0;
+  for (auto _ : state) {
+    std::string destination = "/copy" + std::to_string(copies++);
+    benchmark::DoNotOptimize(cpCommand.execute({source, destination}));
+  }
+  finish(state, 1, residentBefore);
+}
+
+void BM_ProcessCommand(benchmark::State &state, Shape shape) {
+  double residentBefore = residentKilobytes();
+  auto vfs = mountCopy(shape, state.range(0));
+  Parser parser(vfs);
+  const std::string commands[] = {"cd " + sampleDirectory(shape), "ls",
+                                  "cd /", "ls"};
+  for (auto _ : state) {
+    for (const std::string &command : commands) {
+      benchmark::DoNotOptimize(parser.processCommand(command));
+    }
+  }
+  finish(state, std::size(commands), residentBefore);
+}
+
+// Opening the history and the first search, which builds the substring
+// index.
+void BM_HistoryIndex(benchmark::State &state) {
+  double residentBefore = residentKilobytes();
+  std::string path = historyPath(state.range(0));
+  std::unique_ptr<History> history;
+  for (auto _ : state) {
+    history.reset();
+    history = std::make_unique<History>(path);
+    benchmark::DoNotOptimize(history->find("/copy"));
+  }
+  finish(state, state.range(0), residentBefore);
+}
+
+// Ctrl+R queries that do not extend the previous one, so each is a fresh
+// lookup rather than a filter of earlier matches.
+void BM_HistorySearch(benchmark::State &state) {
+  double residentBefore = residentKilobytes();
+  History history(historyPath(state.range(0)));
+  history.find("/copy");
+  const std::string queries[] = {"/copy1234", "tree /c3", "d17", "f99999"};
+  for (auto _ : state) {
+    for (const std::string &query : queries) {
+      HistorySearch search(history);
+      benchmark::DoNotOptimize(search.update(query));
+    }
+  }
+  finish(state, std::size(queries), residentBefore);
+}
+
+template <typename Function>
+void registerBenchmark(const char *name, Function function,
+                       const int64_t *sizesBegin, const int64_t *sizesEnd) {
+  for (Shape shape : {WIDE, DEEP}) {
+    auto *bench = benchmark::RegisterBenchmark(
+        (std::string(name) + "/" + shapeName(shape)).c_str(), function,
+        shape);
+    for (const int64_t *size = sizesBegin; size != sizesEnd; ++size) {
+      bench->Arg(*size);
+    }
+    bench->Unit(benchmark::kMicrosecond)->UseRealTime();
+  }
+}
+
+void registerHistoryBenchmark(const char *name,
+                              void (*function)(benchmark::State &)) {
+  auto *bench = benchmark::RegisterBenchmark(name, function);
+  for (int64_t lines : kHistorySizes) {
+    bench->Arg(lines);
+  }
+  bench->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+int main(int argc, char **argv) {
+  registerBenchmark("Mount", BM_Mount, std::begin(kSizes), std::end(kSizes));
+  registerBenchmark("NormalizePath", BM_NormalizePath, std::begin(kSizes),
+                    std::end(kSizes));
+  registerBenchmark("ListDirectory", BM_ListDirectory, std::begin(kSizes),
+                    std::end(kSizes));
+  registerBenchmark("Complete", BM_Complete, std::begin(kSizes),
+                    std::end(kSizes));
+  registerBenchmark("Cp", BM_Cp, std::begin(kSizes), std::end(kSizes));
+  registerBenchmark("ProcessCommand", BM_ProcessCommand, std::begin(kSizes),
+                    std::end(kSizes));
+  // tree and find walk the whole image; 1M entries is out of reach for them.
+  registerBenchmark("Tree", BM_Tree, std::begin(kTraversalSizes),
+                    std::end(kTraversalSizes));
+  registerBenchmark("Find", BM_Find, std::begin(kTraversalSizes),
+                    std::end(kTraversalSizes));
+
+  registerHistoryBenchmark("HistoryIndex", BM_HistoryIndex);
+  registerHistoryBenchmark("HistorySearch", BM_HistorySearch);
+
+  benchmark::AddCustomContext("git_revision", GIT_REVISION);
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,15 @@
+# Writes OUTPUT defining GIT_REVISION as the commit checked out in
+# SOURCE_DIR. Runs on every build; the header is only rewritten when the
+# revision changed, so an unchanged checkout does not rebuild anything.
+execute_process(COMMAND git rev-parse --short HEAD
+    WORKING_DIRECTORY ${SOURCE_DIR}
+    OUTPUT_VARIABLE GIT_REVISION
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+    ERROR_QUIET)
+set(CONTENT "#pragma once\n#define GIT_REVISION \"${GIT_REVISION}\"\n")
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} PREVIOUS)
+endif()
+if(NOT "${PREVIOUS}" STREQUAL "${CONTENT}")
+    file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
@@ -0,0 +1,54 @@
+#include "core/virtual_filesystem.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Mounts the input as an image, walks everything the index reports, reads
+// the files back and compacts. Inputs that crash, hang or balloon memory are
+// caught by libFuzzer's -timeout and -rss_limit_mb.
+constexpr size_t kMaxVisited = 4096;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static const std::string imagePath =
+      (std::filesystem::temp_directory_path() /
+       ("fuzz-mount-" + std::to_string(getpid()) + ".tar"))
+          .string();
+  {
+    std::ofstream image(imagePath, std::ios::binary | std::ios::trunc);
+    image.write(reinterpret_cast<const char *>(data), size);
+  }
+
+  try {
+    VirtualFilesystem vfs(imagePath);
+    std::vector<std::string> pending = {"/"};
+    for (size_t visited = 0; !pending.empty() && visited < kMaxVisited;
+         ++visited) {
+      std::string path = pending.back();
+      pending.pop_back();
+      bool isDirectory = false;
+      vfs.normalizePath(path, isDirectory);
+      std::string errorMessage;
+      if (isDirectory) {
+        vfs.getTotalsFromStorage(path);
+        for (const std::string &child :
+             vfs.listDirectory(path, errorMessage)) {
+          pending.push_back(path == "/" ? "/" + child : path + "/" + child);
+        }
+      } else {
+        vfs.readFile(path, errorMessage);
+      }
+    }
+    vfs.compact();
+  } catch (const std::exception &) {
+    // Rejecting an image is fine; crashing on it is not.
+  }
+
+  std::filesystem::remove(imagePath);
+  std::filesystem::remove(imagePath + ".journal");
+  std::filesystem::remove(imagePath + ".compact");
+  return 0;
+}
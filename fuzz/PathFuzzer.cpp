@@ -0,0 +1,64 @@
+#include "core/virtual_filesystem.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+// Resolves every line of the input against a small image, starting from the
+// root, and checks that each result is a canonical absolute path that
+// resolves to itself.
+namespace {
+std::unique_ptr<VirtualFilesystem> vfs;
+
+bool isCanonical(const std::string &path) {
+  if (path.empty() || path[0] != '/') {
+    return false;
+  }
+  if (path == "/") {
+    return true;
+  }
+  return path.back() != '/' && path.find("//") == std::string::npos &&
+         (path + "/").find("/./") == std::string::npos &&
+         (path + "/").find("/../") == std::string::npos;
+}
+} // namespace
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() /
+      ("fuzz-path-" + std::to_string(getpid()));
+  std::filesystem::create_directories(directory);
+  std::filesystem::current_path(directory);
+  std::filesystem::remove("fs.tar");
+  vfs = std::make_unique<VirtualFilesystem>();
+  vfs->addFileToArchiveAndStorage("/dir/dir2/deep", 0, FileType::DIR);
+  vfs->addFileToArchiveAndStorage("/dir/dir2/deep/file", 3, FileType::REG);
+  vfs->addFileToArchiveAndStorage("/.hidden", 0, FileType::DIR);
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  vfs->changeDirectory("/");
+  std::istringstream lines(
+      std::string(reinterpret_cast<const char *>(data), size));
+  std::string line;
+  while (std::getline(lines, line)) {
+    bool isDirectory = false;
+    std::string resolved = vfs->normalizePath(line, isDirectory);
+    bool resolvedIsDirectory = false;
+    if (!isCanonical(resolved) ||
+        vfs->normalizePath(resolved, resolvedIsDirectory) != resolved ||
+        resolvedIsDirectory != isDirectory) {
+      std::abort();
+    }
+    vfs->completePath(line);
+    if (isDirectory) {
+      vfs->changeDirectory(line);
+    }
+  }
+  return 0;
+}
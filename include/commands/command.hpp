@@ -1,7 +1,9 @@
 #pragma once
+#include <core/instrumentation.hpp>
 #include <core/virtual_filesystem.hpp>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class Command {
@@ -10,8 +12,10 @@ public:
   virtual std::string execute(const std::vector<std::string> &args) = 0;
 };
 
-class ChangeDirectoryCommand : public Command {
+class ChangeDirectoryCommand final : public Command {
 public:
+  static constexpr std::string_view name = "cd";
+
   ChangeDirectoryCommand(std::shared_ptr<VirtualFilesystem> vfs);
   std::string execute(const std::vector<std::string> &args) override;
 
@@ -19,8 +23,10 @@ private:
   std::shared_ptr<VirtualFilesystem> vfs;
 };
 
-class ListDirectoryCommand : public Command {
+class ListDirectoryCommand final : public Command {
 public:
+  static constexpr std::string_view name = "ls";
+
   ListDirectoryCommand(std::shared_ptr<VirtualFilesystem> vfs);
   std::string execute(const std::vector<std::string> &args) override;
 
@@ -28,8 +34,10 @@ private:
   std::shared_ptr<VirtualFilesystem> vfs;
 };
 
-class CpCommand : public Command {
+class CpCommand final : public Command {
 public:
+  static constexpr std::string_view name = "cp";
+
   CpCommand(std::shared_ptr<VirtualFilesystem> vfs);
   std::string execute(const std::vector<std::string> &args) override;
   std::string copyFile(const std::string &source,
@@ -41,8 +49,10 @@ private:
   std::shared_ptr<VirtualFilesystem> vfs;
 };
 
-class TreeCommand : public Command {
+class TreeCommand final : public Command {
 public:
+  static constexpr std::string_view name = "tree";
+
   TreeCommand(std::shared_ptr<VirtualFilesystem> vfs);
   std::string execute(const std::vector<std::string> &args) override;
   std::string listTree(const std::string &path, bool &isDirectory, int level);
@@ -51,8 +61,10 @@ private:
   std::shared_ptr<VirtualFilesystem> vfs;
 };
 
-class FindCommand : public Command {
+class FindCommand final : public Command {
 public:
+  static constexpr std::string_view name = "find";
+
   FindCommand(std::shared_ptr<VirtualFilesystem> vfs);
   std::string execute(const std::vector<std::string> &args) override;
   std::string findFiles(const std::string &path, const std::string &searchTerm);
@@ -60,3 +72,106 @@ public:
 private:
   std::shared_ptr<VirtualFilesystem> vfs;
 };
+
+class RemoveCommand final : public Command {
+public:
+  static constexpr std::string_view name = "rm";
+
+  RemoveCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class DiskUsageCommand final : public Command {
+public:
+  static constexpr std::string_view name = "du";
+
+  DiskUsageCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class StatCommand final : public Command {
+public:
+  static constexpr std::string_view name = "stat";
+
+  StatCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class CompactCommand final : public Command {
+public:
+  static constexpr std::string_view name = "compact";
+
+  CompactCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+std::string formatImportSummary(const ImportSummary &summary);
+
+class ImportCommand final : public Command {
+public:
+  static constexpr std::string_view name = "import";
+
+  ImportCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+std::string formatExportSummary(const ExportSummary &summary);
+
+class ExportCommand final : public Command {
+public:
+  static constexpr std::string_view name = "export";
+
+  ExportCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class CatCommand final : public Command {
+public:
+  static constexpr std::string_view name = "cat";
+
+  CatCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class CacheCommand final : public Command {
+public:
+  static constexpr std::string_view name = "cache";
+
+  CacheCommand(std::shared_ptr<VirtualFilesystem> vfs);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<VirtualFilesystem> vfs;
+};
+
+class StatsCommand final : public Command {
+public:
+  static constexpr std::string_view name = "stats";
+
+  StatsCommand(std::shared_ptr<instrumentation::CommandMetrics> metrics);
+  std::string execute(const std::vector<std::string> &args) override;
+
+private:
+  std::shared_ptr<instrumentation::CommandMetrics> metrics;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+struct BlockCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  // Blocks loaded ahead of a sequential reader, and how many of them were
+  // read before being evicted.
+  uint64_t readAhead = 0;
+  uint64_t readAheadHits = 0;
+  // Misses on blocks recently evicted from the probation queue, which sends
+  // them to the protected one.
+  uint64_t ghostHits = 0;
+  uint64_t evictions = 0;
+  uint64_t bytes = 0;
+  uint64_t budget = 0;
+};
+
+// Fixed-size blocks of archive data keyed by their offset, held under a byte
+// budget. Replacement follows 2Q: a block enters a FIFO probation queue and
+// only moves to the LRU protected queue when it is requested again after
+// being evicted from probation, which a key-only ghost queue remembers. A
+// one-off scan therefore cycles through probation without displacing the
+// working set. Sequential readers get read-ahead: each miss that continues
+// the previous read loads a window of following blocks in one call, and the
+// window doubles while the pattern holds.
+//
+// Not thread-safe; VirtualFilesystem serializes access.
+class BlockCache {
+public:
+  static constexpr size_t kBlockSize = 64 << 10;
+
+  // Fills `buffer` with up to `length` bytes at `offset` and returns how
+  // many were read; fewer means the end of the archive.
+  using Loader =
+      std::function<size_t(char *buffer, size_t length, uint64_t offset)>;
+
+  explicit BlockCache(uint64_t budget = 64 << 20);
+
+  // Copies `length` bytes at `offset` into `out` and returns how many were
+  // available.
+  size_t read(uint64_t offset, size_t length, char *out, const Loader &load);
+
+  // Drops every block holding bytes at or after `offset`, for when the
+  // archive is rewritten from there.
+  void invalidateFrom(uint64_t offset);
+  void clear();
+
+  void setBudget(uint64_t budget);
+  BlockCacheStats stats() const;
+
+private:
+  enum class Queue { PROBATION, PROTECTED };
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+    Queue queue;
+    std::list<uint64_t>::iterator position;
+    bool prefetched;
+  };
+
+  uint64_t budget;
+  uint64_t bytes;
+  uint64_t probationBytes;
+  std::unordered_map<uint64_t, Block> blocks;
+  // Front is the newest block of each queue.
+  std::list<uint64_t> probation;
+  std::list<uint64_t> protectedBlocks;
+  std::list<uint64_t> ghosts;
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> ghostIndex;
+
+  uint64_t nextSequential;
+  size_t readAheadWindow;
+  BlockCacheStats counters;
+
+  // Loads blocks [first, first + count) that are not cached yet, in runs.
+  void load(uint64_t first, uint64_t count, const Loader &loader,
+            bool prefetch);
+  void insert(uint64_t index, std::unique_ptr<char[]> data, size_t size,
+              bool prefetched);
+  void remove(std::unordered_map<uint64_t, Block>::iterator block);
+  void evict();
+  size_t maxReadAhead() const;
+};
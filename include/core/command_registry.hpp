@@ -0,0 +1,122 @@
+#pragma once
+#include "instrumentation.hpp"
+#include "virtual_filesystem.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Commands known at compile time. Each one names itself through a
+// `static constexpr std::string_view name` member; adding a command means
+// adding its type to the registry's parameter list. Names are looked up in a
+// perfect hash table computed by the compiler, and the matching command is
+// called directly rather than through the Command vtable.
+template <typename... Commands> class CommandRegistry {
+public:
+  static constexpr size_t size = sizeof...(Commands);
+  static constexpr std::array<std::string_view, size> names = {
+      Commands::name...};
+  static constexpr std::array<std::string_view, size> sortedNames = [] {
+    std::array<std::string_view, size> sorted = names;
+    for (size_t i = 1; i < size; ++i) {
+      for (size_t j = i; j > 0 && sorted[j] < sorted[j - 1]; --j) {
+        std::string_view name = sorted[j];
+        sorted[j] = sorted[j - 1];
+        sorted[j - 1] = name;
+      }
+    }
+    return sorted;
+  }();
+
+  CommandRegistry(std::shared_ptr<VirtualFilesystem> vfs,
+                  std::shared_ptr<instrumentation::CommandMetrics> metrics)
+      : commands(create<Commands>(vfs, metrics)...) {}
+
+  // Runs the command called `name`. Returns false if there is none.
+  bool execute(std::string_view name, const std::vector<std::string> &args,
+               std::string &result) {
+    size_t index = slots[slotOf(name, seed)];
+    if (index == 0 || names[index - 1] != name) {
+      return false;
+    }
+    result = handlers[index - 1](commands, args);
+    return true;
+  }
+
+private:
+  using Storage = std::tuple<Commands...>;
+  using Handler = std::string (*)(Storage &,
+                                  const std::vector<std::string> &);
+
+  // Smallest power of two with at most half of its slots taken.
+  static constexpr size_t tableSize = [] {
+    size_t tableSize = 1;
+    while (tableSize < 2 * size) {
+      tableSize *= 2;
+    }
+    return tableSize;
+  }();
+
+  static constexpr size_t slotOf(std::string_view name, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+    for (char c : name) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+    return (hash ^ (hash >> 29)) & (tableSize - 1);
+  }
+
+  // First seed under which no two names share a slot.
+  static constexpr uint64_t seed = [] {
+    for (uint64_t seed = 0; seed < 4096; ++seed) {
+      std::array<bool, tableSize> taken{};
+      bool collision = false;
+      for (std::string_view name : names) {
+        size_t slot = slotOf(name, seed);
+        collision = collision || taken[slot];
+        taken[slot] = true;
+      }
+      if (!collision) {
+        return seed;
+      }
+    }
+    return ~uint64_t{0};
+  }();
+  static_assert(seed != ~uint64_t{0},
+                "command names have no perfect hash; duplicate name?");
+
+  // Slot -> 1-based command index, 0 for an empty slot.
+  static constexpr std::array<uint8_t, tableSize> slots = [] {
+    std::array<uint8_t, tableSize> slots{};
+    for (size_t i = 0; i < size; ++i) {
+      slots[slotOf(names[i], seed)] = static_cast<uint8_t>(i + 1);
+    }
+    return slots;
+  }();
+
+  template <typename Command>
+  static std::string invoke(Storage &commands,
+                            const std::vector<std::string> &args) {
+    return std::get<Command>(commands).execute(args);
+  }
+  static constexpr std::array<Handler, size> handlers = {
+      &invoke<Commands>...};
+
+  template <typename Command>
+  static Command
+  create(const std::shared_ptr<VirtualFilesystem> &vfs,
+         const std::shared_ptr<instrumentation::CommandMetrics> &metrics) {
+    if constexpr (std::is_constructible_v<
+                      Command, std::shared_ptr<VirtualFilesystem>>) {
+      return Command(vfs);
+    } else {
+      return Command(metrics);
+    }
+  }
+
+  Storage commands;
+};
@@ -1,6 +1,11 @@
 #pragma once
+#include <cstdint>
+#include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 enum FileType { REG, DIR };
 
@@ -8,18 +13,91 @@ struct Metadata {
   std::string path;
   size_t size;
   FileType fileType;
+  // Offset of the payload in the archive, 0 if it has not been written yet.
+  uint64_t offset;
 
-  Metadata(const std::string &path, size_t size, FileType fileType)
-      : path(path), size(size), fileType(fileType) {}
-  Metadata() : path(""), size(0), fileType(FileType::REG) {}
+  Metadata(const std::string &path, size_t size, FileType fileType,
+           uint64_t offset = 0)
+      : path(path), size(size), fileType(fileType), offset(offset) {}
+  Metadata() : path(""), size(0), fileType(FileType::REG), offset(0) {}
 };
 
+// Aggregates over everything below a directory, the directory excluded.
+struct DirectoryTotals {
+  uint64_t bytes = 0;
+  uint64_t files = 0;
+  uint64_t directories = 0;
+
+  DirectoryTotals &operator+=(const DirectoryTotals &other);
+  DirectoryTotals &operator-=(const DirectoryTotals &other);
+};
+
+// Index of the image. Entries loaded from an archive are kept in a compact
+// sorted table and only turned into Metadata and directory nodes when their
+// directory is first listed or resolved.
 class FileStorage {
 public:
-  std::unordered_map<std::string, Metadata> files;
-  void add(const std::string &path, size_t size, FileType fileType);
+  void add(const std::string &path, size_t size, FileType fileType,
+           uint64_t offset = 0);
+  // Inserts entries known not to exist yet, parents before children, and
+  // updates directory totals once per parent instead of once per entry.
+  void addBatch(const std::vector<Metadata> &entries);
   bool remove(const std::string &path);
+  // Records where the entry's data now starts in the archive.
+  void setOffset(const std::string &path, uint64_t offset);
   bool exists(const std::string &path) const;
   const Metadata &getMetadata(const std::string &path) const;
+  const std::set<std::string> &listChildren(const std::string &path) const;
+  // Subtree totals of a directory: a cached prefix-sum range over the
+  // archive table plus deltas kept up to date by add() and remove().
+  DirectoryTotals getTotals(const std::string &path) const;
+
+  // Records an archive entry without materializing it. Call sealLazy() once
+  // all entries are recorded.
+  void addLazy(const std::string &path, size_t size, FileType fileType,
+               uint64_t offset);
+  // Records a hard link entry whose own (empty) payload would start at
+  // `offset`. It takes the size and payload of the latest entry for
+  // `target` that precedes it in the archive.
+  void addLazyLink(const std::string &path, const std::string &target,
+                   uint64_t offset);
+  // Sorts the lazy table and resolves hard links, keeping the last entry of
+  // every path. Returns the number of superseded entries.
+  size_t sealLazy();
   FileStorage();
+
+private:
+  struct LazyEntry {
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    FileType fileType;
+    uint64_t size;
+    uint64_t offset;
+  };
+  struct LazyLink {
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    std::string target;
+    uint64_t offset;
+  };
+
+  mutable std::unordered_map<std::string, Metadata> files;
+  mutable std::unordered_map<std::string, std::set<std::string>> children;
+  mutable std::unordered_set<std::string> materialized;
+  std::string lazyPaths;
+  std::vector<LazyEntry> lazyEntries;
+  std::vector<LazyLink> lazyLinks;
+  std::vector<DirectoryTotals> lazyPrefixTotals;
+  mutable std::unordered_map<std::string, DirectoryTotals> lazyTotals;
+  std::unordered_map<std::string, DirectoryTotals> totalsDeltas;
+
+  std::string_view lazyPath(const LazyEntry &entry) const;
+  const LazyEntry *findLazy(const std::string &path) const;
+  void resolveLazyLinks();
+  void materialize(const std::string &directory) const;
+  void insert(const std::string &path, size_t size, FileType fileType,
+              uint64_t offset) const;
+  void addToAncestors(const std::string &path, const DirectoryTotals &delta);
+  void removeFromAncestors(const std::string &path,
+                           const DirectoryTotals &delta);
 };
@@ -0,0 +1,29 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <thread>
+
+// Calls `onChange` from a background thread whenever the file at `path` is
+// written to or replaced by any process. The parent directory is watched
+// rather than the file itself so the watch survives the file being renamed
+// over, as compaction does. Bursts of writes are coalesced into one call.
+//
+// Uses inotify and so only watches on Linux; elsewhere it never calls back.
+class FileWatcher {
+public:
+  FileWatcher(const std::string &path, std::function<void()> onChange);
+  ~FileWatcher();
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+private:
+  std::function<void()> onChange;
+#ifdef __linux__
+  std::string name;
+  int inotifyFd;
+  int stopFd;
+  std::thread thread;
+
+  void run();
+#endif
+};
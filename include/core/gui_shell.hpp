@@ -1,22 +1,48 @@
 #pragma once
+#include "core/history.hpp"
 #include "core/parser.hpp"
+#include <atomic>
 #include <memory>
 #include <nana/gui.hpp>
+#include <nana/gui/timer.hpp>
 #include <nana/gui/widgets/button.hpp>
+#include <nana/gui/widgets/label.hpp>
 #include <nana/gui/widgets/textbox.hpp>
+#include <string>
 
 class GUIShell {
 public:
-  explicit GUIShell(std::shared_ptr<VirtualFilesystem> vfs);
+  explicit GUIShell(
+      std::shared_ptr<VirtualFilesystem> vfs,
+      std::shared_ptr<instrumentation::CommandMetrics> metrics = nullptr,
+      const std::string &historyPath = "");
+  ~GUIShell();
   void run();
+  // Picks up entries other programs append to the archive and re-runs the
+  // last listing when some arrive.
+  void watchArchive();
 
 private:
   std::unique_ptr<Parser> parser;
   std::shared_ptr<VirtualFilesystem> vfs;
-  
+  History history;
+  // Set while a Ctrl+R search is open; the input box then holds the query.
+  std::unique_ptr<HistorySearch> search;
+  std::string searchMatch;
+  // Counted by the watcher thread, shown by the timer on the GUI thread.
+  std::atomic<size_t> appendedEntries{0};
+  std::string lastListing;
+
   nana::form fm;
   nana::textbox input_box;
   nana::textbox output_box;
+  nana::label search_label;
+  nana::timer archive_timer;
 
   void on_execute();
+  void on_complete();
+  void on_history(std::optional<std::string_view> line);
+  void on_search(std::optional<std::string_view> match);
+  void end_search(bool accept);
+  void on_archive_changed();
 };
\ No newline at end of file
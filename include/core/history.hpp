@@ -0,0 +1,96 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Command history backed by an append-only file with one command per line.
+// Lines saved by earlier sessions are read straight from a read-only mapping
+// of the file, so opening a long history costs one scan for line breaks and
+// a few bytes of index per line; commands added in this session are kept in
+// memory and appended to the file as they are entered.
+class History {
+public:
+  // An empty path keeps the history in memory only.
+  explicit History(const std::string &path = "");
+  ~History();
+  History(const History &) = delete;
+  History &operator=(const History &) = delete;
+
+  // Records a command. Blank commands and repeats of the last one are
+  // dropped.
+  void add(std::string_view command);
+
+  size_t size() const { return savedLines() + addedStarts.size() - 1; }
+  // Line `index`, oldest first. The view is valid until the next add().
+  std::string_view at(size_t index) const;
+
+  // Up/Down navigation. The cursor sits past the newest line until
+  // previous() is called, and returns there on add() or reset(); stepping
+  // back onto it with next() yields an empty line. Both return nothing when
+  // there is no line to move to.
+  std::optional<std::string_view> previous();
+  std::optional<std::string_view> next();
+  void reset() { cursor = size(); }
+
+  // Indices of the lines containing `needle`, oldest first. Needles of
+  // three bytes or more are looked up in a trigram index of the saved
+  // lines, built on the first such search; only lines holding all of the
+  // needle's trigrams are compared. Shorter needles, and lines added in this
+  // session, are scanned.
+  std::vector<uint32_t> find(std::string_view needle) const;
+
+private:
+  std::FILE *file;
+  const char *mapped;
+  size_t mappedSize;
+#ifdef _WIN32
+  // Windows reads the file instead of mapping it.
+  std::string contents;
+#endif
+  // Start of every line in the mapping, and of every line in `added`, each
+  // followed by a sentinel one past the last newline. A line ends one byte
+  // before the next start.
+  std::vector<uint64_t> lineStarts;
+  std::string added;
+  std::vector<uint32_t> addedStarts;
+  size_t cursor;
+
+  // Saved lines holding each trigram, ascending, as a range of
+  // `trigramLines`.
+  struct Postings {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t lastLine;
+  };
+  mutable std::unordered_map<uint32_t, Postings> trigrams;
+  mutable std::vector<uint32_t> trigramLines;
+  mutable bool trigramsIndexed = false;
+
+  size_t savedLines() const { return lineStarts.size() - 1; }
+  void load(const std::string &path);
+  void indexTrigrams() const;
+};
+
+// Reverse incremental search, as on Ctrl+R. A query that extends the
+// previous one only re-checks the lines that matched it.
+class HistorySearch {
+public:
+  explicit HistorySearch(const History &history) : history(history) {}
+
+  // Sets the query and returns the newest matching line, if any.
+  std::optional<std::string_view> update(const std::string &query);
+  // The next older line matching the current query, if any.
+  std::optional<std::string_view> older();
+
+private:
+  const History &history;
+  std::string query;
+  std::vector<uint32_t> matches;
+  size_t position = 0;
+  bool searched = false;
+};
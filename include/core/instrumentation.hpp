@@ -0,0 +1,60 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace instrumentation {
+
+// Process-wide counters, bumped by the storage and archive layers and by
+// the global allocator. Background threads (compaction, journal folding)
+// are counted too.
+extern std::atomic<uint64_t> storageLookups;
+extern std::atomic<uint64_t> archiveBytesRead;
+extern std::atomic<uint64_t> allocations;
+extern std::atomic<uint64_t> allocatedBytes;
+// Journal writes that reached the disk, each with one fsync.
+extern std::atomic<uint64_t> journalSyncs;
+
+struct Snapshot {
+  uint64_t storageLookups;
+  uint64_t archiveBytesRead;
+  uint64_t allocations;
+  uint64_t allocatedBytes;
+
+  static Snapshot take();
+};
+
+// Latency bucket i holds commands that took [2^(i-1), 2^i) microseconds;
+// bucket 0 holds those under one microsecond.
+constexpr size_t kLatencyBuckets = 32;
+
+struct CommandStats {
+  uint64_t calls = 0;
+  uint64_t totalMicros = 0;
+  uint64_t maxMicros = 0;
+  std::array<uint64_t, kLatencyBuckets> latencyHistogram{};
+  uint64_t storageLookups = 0;
+  uint64_t archiveBytesRead = 0;
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+
+  // Upper bound of the bucket holding the given quantile, in microseconds.
+  uint64_t percentileMicros(double quantile) const;
+};
+
+class CommandMetrics {
+public:
+  void record(const std::string &command, std::chrono::nanoseconds elapsed,
+              const Snapshot &before, const Snapshot &after);
+  void reset();
+  std::string report() const;
+  std::string toJson() const;
+
+private:
+  std::map<std::string, CommandStats> commands;
+};
+
+} // namespace instrumentation
@@ -0,0 +1,51 @@
+#pragma once
+#include "file_storage.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class JournalOp : uint8_t { ADD, REMOVE, COPY };
+
+struct JournalRecord {
+  JournalOp op;
+  FileType fileType;
+  uint64_t size;
+  std::string path;
+  std::string source;
+};
+
+// Append-only log of metadata mutations that have not been folded into the
+// archive yet. Records are framed with a length and checksum so a torn tail
+// left by a crash is detected and dropped on replay.
+class Journal {
+public:
+  explicit Journal(const std::string &path);
+  ~Journal();
+
+  // Buffers a record and returns its sequence number.
+  uint64_t append(const JournalRecord &record);
+  // Blocks until every record up to `sequence` is on disk. Concurrent
+  // callers are served by a single write and fsync; callers whose records
+  // were in a failed write retry it before giving up.
+  void commit(uint64_t sequence);
+  // Discards all records once they have been folded into the archive,
+  // except `keep`, which becomes the whole journal. The new journal is
+  // synced beside the old one and renamed over it; on failure the old one
+  // stays in use.
+  void reset(const std::vector<JournalRecord> &keep = {});
+
+  static std::vector<JournalRecord> replay(const std::string &path);
+
+private:
+  std::string path;
+  std::FILE *file;
+  std::mutex mutex;
+  std::condition_variable flushed;
+  std::string buffer;
+  uint64_t appended;
+  uint64_t durable;
+  bool flushing;
+};
@@ -1,14 +1,39 @@
 #pragma once
 #include "commands/command.hpp"
+#include "command_registry.hpp"
+#include "instrumentation.hpp"
 #include "virtual_filesystem.hpp"
-#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 class Parser {
 public:
-  explicit Parser(std::shared_ptr<VirtualFilesystem> vfs);
+  explicit Parser(
+      std::shared_ptr<VirtualFilesystem> vfs,
+      std::shared_ptr<instrumentation::CommandMetrics> metrics = nullptr);
   std::string processCommand(const std::string &input);
+  // Runs `input` like processCommand() but leaves it out of the metrics,
+  // for output the shell refreshes on its own rather than at the user's
+  // request.
+  std::string refreshCommand(const std::string &input);
+  // Completes the last word of `input`: a command name if it is the first
+  // word, a path otherwise. Returns `input` extended by the longest prefix
+  // shared by all candidates, which are stored in `candidates`.
+  std::string complete(const std::string &input,
+                       std::vector<std::string> &candidates);
+
+  using Commands =
+      CommandRegistry<ChangeDirectoryCommand, ListDirectoryCommand, CpCommand,
+                      TreeCommand, FindCommand, RemoveCommand,
+                      DiskUsageCommand, StatCommand, ImportCommand,
+                      ExportCommand, CatCommand, CacheCommand,
+                      CompactCommand, StatsCommand>;
+
 private:
-  std::unordered_map<std::string, std::unique_ptr<Command>> commands;
+  std::shared_ptr<VirtualFilesystem> vfs;
+  std::shared_ptr<instrumentation::CommandMetrics> metrics;
+  Commands commands;
+
+  std::string run(const std::string &input, bool record);
 };
@@ -1,11 +1,39 @@
 #pragma once
+#include "block_cache.hpp"
 #include "file_storage.hpp"
+#include "file_watcher.hpp"
+#include "journal.hpp"
 #include <boost/filesystem.hpp>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+struct ImportSummary {
+  uint64_t files = 0;
+  uint64_t directories = 0;
+  uint64_t bytes = 0;
+  uint64_t skipped = 0;
+  // Files stored as hard links to identical content.
+  uint64_t deduplicated = 0;
+};
+
+struct ExportSummary {
+  uint64_t files = 0;
+  uint64_t directories = 0;
+  uint64_t bytes = 0;
+};
+
 class VirtualFilesystem {
 public:
   VirtualFilesystem(const std::string &path = "");
@@ -17,21 +45,137 @@ public:
   std::string getCurrentDirectory();
   std::string normalizePath(const std::string &path, bool &isDirectory);
 
+  // Completions of the last segment of `partial`, resolved against the
+  // current directory like any other path. Each keeps the directory part as
+  // typed; directories end in '/'. Served by a binary search in the
+  // directory's sorted children, at most `limit` results.
+  std::vector<std::string> completePath(const std::string &partial,
+                                        size_t limit = 256);
+
+  // Contents of the regular file at `path`, read through the block cache.
+  std::string readFile(const std::string &path, std::string &errorMessage);
+  void setCacheBudget(uint64_t bytes);
+  BlockCacheStats getCacheStats() const;
+
   bool existsInStorage(const std::string &path) const;
-  const Metadata &getMetadataFromStorage(const std::string &path) const;
+  // Copies, since another thread may replace or drop the entry as soon as
+  // the lock is released.
+  Metadata getMetadataFromStorage(const std::string &path) const;
+  // Metadata of `path` from a single locked lookup, if it exists.
+  std::optional<Metadata> findInStorage(const std::string &path) const;
+  DirectoryTotals getTotalsFromStorage(const std::string &path) const;
   bool addFileToStorage(const std::string &path, size_t size,
                         FileType fileType);
   bool addFileToArchiveAndStorage(const std::string &path, size_t size,
                                   FileType fileType);
+  bool copyInArchiveAndStorage(const std::string &source,
+                               const std::string &destination);
+  // Copies each source to its destination in order, stopping at the first
+  // that fails, and returns how many were copied. The whole batch waits for
+  // a single journal commit.
+  size_t copyInArchiveAndStorage(
+      const std::vector<std::pair<std::string, std::string>> &copies);
+  bool removeFromArchiveAndStorage(const std::string &path);
+
+  // Copies a host directory tree below `directory`. Host files are stat'ed
+  // and read by `threads` workers while this thread appends them to the
+  // archive in one sequential pass; existing paths are skipped.
+  ImportSummary importDirectory(const std::string &hostDirectory,
+                                const std::string &directory,
+                                unsigned threads = 0);
+  // Writes `path` and everything below it into `hostDirectory`. Directories
+  // are created up front; file contents are then copied by `threads` workers
+  // with positional reads at the offsets kept in the index.
+  ExportSummary exportDirectory(const std::string &path,
+                                const std::string &hostDirectory,
+                                unsigned threads = 0);
+
+  // Rewrites the archive from the live index, dropping duplicate and removed
+  // entries, and atomically swaps it in. Returns the number of bytes
+  // reclaimed.
+  uint64_t compact();
+  // Compacts in the background once no mutation happened for `delay`.
+  // A zero delay disables the idle compactor.
+  void setIdleCompactionDelay(std::chrono::milliseconds delay);
+
+  // Indexes entries another program appended to the archive since it was
+  // last read, as `tar -r` does, and returns how many. Only the new tail is
+  // read.
+  size_t refresh();
+  // Refreshes whenever the archive changes on disk and passes the number of
+  // merged entries to `onChange`, from a background thread. An empty
+  // callback stops watching.
+  void watchArchive(std::function<void(size_t merged)> onChange);
 
 private:
   std::string archivePath;
   std::string currentDirectory;
-  struct archive *archive;
   std::unique_ptr<FileStorage> fileStorage;
 
+  // Mutations are acknowledged once they reach the journal and are folded
+  // into the archive at `dataEnd`, the offset of its end-of-archive marker.
+  uint64_t dataEnd;
+  std::unique_ptr<Journal> journal;
+  std::vector<JournalRecord> pendingRecords;
+  // Folded removals whose entries are still in the archive, by path. They
+  // stay in the journal until compaction drops the entries.
+  std::unordered_map<std::string, JournalRecord> pendingRemovals;
+
+  mutable std::recursive_mutex mutex;
+  size_t staleEntries;
+  std::chrono::steady_clock::time_point lastMutation;
+  std::chrono::milliseconds idleCompactionDelay;
+  std::condition_variable_any compactorWake;
+  bool stopCompactor;
+  std::thread compactor;
+  // Set while compaction copies the archive without holding the lock.
+  // Appends to the archive wait for it to finish.
+  bool compacting;
+  std::condition_variable_any compactionDone;
+
+  // Content hash -> path holding that payload. Existing payloads are listed
+  // by size on first import and hashed only once an imported file has the
+  // same size. Entries may be stale; every match is checked against the
+  // bytes.
+  std::unordered_multimap<uint64_t, std::string> contentIndex;
+  std::unordered_map<uint64_t, std::vector<std::string>> unhashedPayloads;
+  bool contentIndexed;
+
+  // Archive blocks read by readFile(). Appends drop the blocks past the old
+  // end of data and compaction drops them all, since both rewrite them.
+  BlockCache blockCache;
+
+  std::unique_ptr<FileWatcher> watcher;
+
   void loadArchive();
+  size_t mergeTail();
   void createDefaultArchive();
-  void addFileToArchive(const std::string &path, size_t size,
-                        FileType fileType);
+  // Returns the offset of the entry's data from where `writer` started. The
+  // payload is copied from `content` at `contentOffset` when given.
+  uint64_t addFileToArchive(struct archive *writer, const std::string &path,
+                            size_t size, FileType fileType,
+                            std::FILE *content = nullptr,
+                            uint64_t contentOffset = 0);
+  void addLinkToArchive(struct archive *writer, const std::string &path,
+                        const std::string &target);
+  std::string journalPath() const;
+  struct archive *openAppendWriter(std::FILE *&file,
+                                   int bytesPerBlock = 10240);
+  void closeAppendWriter(struct archive *writer, std::FILE *file);
+  void applyRecord(const JournalRecord &record);
+  // Appends `record` to the journal and the pending batch under the lock.
+  // The returned sequence goes to commitRecords() once the lock is released.
+  uint64_t logRecord(JournalRecord record);
+  bool commitRecords(uint64_t sequence);
+  void foldJournal();
+  void appendRecords();
+  void resetJournal();
+  uint64_t foldCopy(struct archive *writer, std::FILE *archive,
+                    uint64_t appendStart, const JournalRecord &record);
+  // Called with `lock` held once; releases it while copying.
+  uint64_t compactArchive(std::unique_lock<std::recursive_mutex> &lock);
+  void runIdleCompactor();
+  void indexContent();
+  // Moves the unhashed payloads of `size` bytes into the content index.
+  void hashPayloads(uint64_t size, std::FILE *archive);
 };
@@ -1,13 +1,16 @@
+#include "commands/command.hpp"
 #include "core/gui_shell.hpp"
 #include "core/parser.hpp"
 #include "core/virtual_filesystem.hpp"
 #include <boost/program_options.hpp>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 
 std::string getFilesystemPath(const boost::program_options::variables_map &vm);
+std::string getDefaultHistoryPath();
 
 int main(int argc, char *argv[]) {
   namespace po = boost::program_options;
@@ -17,7 +20,26 @@ int main(int argc, char *argv[]) {
     desc.add_options()("help,h", "Show help message")(
         "fs,f", po::value<std::string>(),
         "Path to the virtual filesystem in tar archive")(
-        "create,c", "Create a new virtual filesystem");
+        "create,c", "Create a new virtual filesystem")(
+        "compact-idle", po::value<int>()->default_value(30),
+        "Seconds of inactivity before the archive is compacted (0 disables)")(
+        "cache-mb", po::value<int>()->default_value(64),
+        "Memory budget of the file content cache in MiB")(
+        "no-watch", "Do not pick up entries other programs append to the "
+                    "archive while it is open")(
+        "stats-json", po::value<std::string>(),
+        "Write per-command statistics as JSON to this file on exit")(
+        "import", po::value<std::string>(),
+        "Import a host directory into the filesystem and exit")(
+        "import-to", po::value<std::string>()->default_value("/"),
+        "Directory of the filesystem to import into")(
+        "export", po::value<std::string>(),
+        "Extract the filesystem into a host directory and exit")(
+        "export-from", po::value<std::string>()->default_value("/"),
+        "File or directory of the filesystem to extract")(
+        "history",
+        po::value<std::string>()->default_value(getDefaultHistoryPath()),
+        "File the command history is kept in (empty to not keep one)");
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -29,19 +51,45 @@ int main(int argc, char *argv[]) {
 
     po::notify(vm);
 
+    std::shared_ptr<VirtualFilesystem> vfs;
     if (vm.count("create")) {
-      auto vfs = std::make_shared<VirtualFilesystem>();
-      GUIShell shell(vfs);
-      shell.run();
+      vfs = std::make_shared<VirtualFilesystem>();
     } else if (vm.count("fs")) {
       std::string fsPath = getFilesystemPath(vm);
-      auto vfs = std::make_shared<VirtualFilesystem>(fsPath);
-      GUIShell shell(vfs);
-      shell.run();
+      vfs = std::make_shared<VirtualFilesystem>(fsPath);
     } else {
       throw std::runtime_error(
           "Either --create or --fs option must be specified.");
     }
+
+    if (vm.count("import")) {
+      ImportSummary summary = vfs->importDirectory(
+          vm["import"].as<std::string>(), vm["import-to"].as<std::string>());
+      std::cout << formatImportSummary(summary) << std::endl;
+      return 0;
+    }
+
+    if (vm.count("export")) {
+      ExportSummary summary = vfs->exportDirectory(
+          vm["export-from"].as<std::string>(), vm["export"].as<std::string>());
+      std::cout << formatExportSummary(summary) << std::endl;
+      return 0;
+    }
+
+    vfs->setIdleCompactionDelay(
+        std::chrono::seconds(vm["compact-idle"].as<int>()));
+    vfs->setCacheBudget(static_cast<uint64_t>(vm["cache-mb"].as<int>()) << 20);
+    auto metrics = std::make_shared<instrumentation::CommandMetrics>();
+    GUIShell shell(vfs, metrics, vm["history"].as<std::string>());
+    if (!vm.count("no-watch")) {
+      shell.watchArchive();
+    }
+    shell.run();
+
+    if (vm.count("stats-json")) {
+      std::ofstream statsFile(vm["stats-json"].as<std::string>());
+      statsFile << metrics->toJson() << '\n';
+    }
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << std::endl;
     return 1;
@@ -56,4 +104,12 @@ std::string getFilesystemPath(const boost::program_options::variables_map &vm) {
   if (!file.good())
     throw std::runtime_error("File not found: " + fsPath);
   return fsPath;
-}
\ No newline at end of file
+}
+std::string getDefaultHistoryPath() {
+#ifdef _WIN32
+  const char *home = std::getenv("USERPROFILE");
+#else
+  const char *home = std::getenv("HOME");
+#endif
+  return home == nullptr ? "" : std::string(home) + "/.cpp_terminal_history";
+}
@@ -1,5 +1,8 @@
 #include "commands/command.hpp"
+#include <iomanip>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <vector>
 
 ChangeDirectoryCommand::ChangeDirectoryCommand(
@@ -64,7 +67,8 @@ std::string CpCommand::execute(const std::vector<std::string> &args) {
   std::string normalizedDestination =
       vfs->normalizePath(destination, destinationIsDir);
 
-  if (!vfs->existsInStorage(normalizedSource)) {
+  std::optional<Metadata> srcMetadata = vfs->findInStorage(normalizedSource);
+  if (!srcMetadata) {
     return "cp: source file or directory does not exist: " + source;
   }
 
@@ -77,10 +81,9 @@ std::string CpCommand::execute(const std::vector<std::string> &args) {
     return "cp: target already exists: " + destination;
   }
 
-  const Metadata &srcMetadata = vfs->getMetadataFromStorage(normalizedSource);
-  if (srcMetadata.fileType == FileType::REG) {
+  if (srcMetadata->fileType == FileType::REG) {
     return copyFile(normalizedSource, normalizedDestination);
-  } else if (srcMetadata.fileType == FileType::DIR) {
+  } else if (srcMetadata->fileType == FileType::DIR) {
     return copyDirectory(normalizedSource, normalizedDestination);
   }
 
@@ -89,8 +92,7 @@ std::string CpCommand::execute(const std::vector<std::string> &args) {
 
 std::string CpCommand::copyFile(const std::string &source,
                                 const std::string &destination) {
-  size_t size = vfs->getMetadataFromStorage(source).size;
-  if (vfs->addFileToArchiveAndStorage(destination, size, FileType::REG)) {
+  if (vfs->copyInArchiveAndStorage(source, destination)) {
     return "";
   }
   return "cp: failed to copy file: " + source;
@@ -102,22 +104,16 @@ std::string CpCommand::copyDirectory(const std::string &source,
     return "cp: failed to create directory: " + destination;
   }
 
+  // One batch, so the whole directory costs a single journal commit.
   std::string errorMessage;
   auto files = vfs->listDirectory(source, errorMessage);
+  std::vector<std::pair<std::string, std::string>> copies;
   for (const std::string &file : files) {
-    std::string srcPath = source + "/" + file;
-    std::string destPath = destination + "/" + file;
-    const Metadata &metadata = vfs->getMetadataFromStorage(srcPath);
-    if (metadata.fileType == FileType::REG) {
-      if (!vfs->addFileToArchiveAndStorage(destPath, metadata.size,
-                                           FileType::REG)) {
-        return "cp: failed to copy file: " + file;
-      }
-    } else if (metadata.fileType == FileType::DIR) {
-      if (!vfs->addFileToArchiveAndStorage(destPath, 0, FileType::DIR)) {
-        return "cp: failed to copy directory: " + file;
-      }
-    }
+    copies.emplace_back(source + "/" + file, destination + "/" + file);
+  }
+  size_t copied = vfs->copyInArchiveAndStorage(copies);
+  if (copied < files.size()) {
+    return "cp: failed to copy: " + files[copied];
   }
 
   return "";
@@ -189,4 +185,220 @@ std::string FindCommand::findFiles(const std::string &path,
     output += findFiles(fullPath, searchTerm);
   }
   return output;
+}
+
+RemoveCommand::RemoveCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string RemoveCommand::execute(const std::vector<std::string> &args) {
+  if (args.size() != 1) {
+    return "rm: missing operand";
+  }
+
+  bool isDirectory = false;
+  std::string path = vfs->normalizePath(args[0], isDirectory);
+  if (!vfs->existsInStorage(path)) {
+    return "rm: cannot remove '" + args[0] + "': No such file or directory";
+  }
+
+  if (isDirectory) {
+    std::string errorMessage;
+    if (path == "/" || !vfs->listDirectory(path, errorMessage).empty()) {
+      return "rm: cannot remove '" + args[0] + "': Directory not empty";
+    }
+  }
+
+  if (!vfs->removeFromArchiveAndStorage(path)) {
+    return "rm: failed to remove '" + args[0] + "'";
+  }
+  return "";
+}
+
+DiskUsageCommand::DiskUsageCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string DiskUsageCommand::execute(const std::vector<std::string> &args) {
+  if (args.size() > 1) {
+    return "du: too many arguments";
+  }
+
+  std::string target = args.empty() ? "." : args[0];
+  bool isDirectory = false;
+  std::string path = vfs->normalizePath(target, isDirectory);
+  std::optional<Metadata> metadata = vfs->findInStorage(path);
+  if (!metadata) {
+    return "du: cannot access '" + target + "': No such file or directory";
+  }
+
+  uint64_t bytes = isDirectory ? vfs->getTotalsFromStorage(path).bytes
+                               : metadata->size;
+  return std::to_string(bytes) + "\t" + path;
+}
+
+StatCommand::StatCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string StatCommand::execute(const std::vector<std::string> &args) {
+  if (args.size() != 1) {
+    return "stat: missing operand";
+  }
+
+  bool isDirectory = false;
+  std::string path = vfs->normalizePath(args[0], isDirectory);
+  std::optional<Metadata> metadata = vfs->findInStorage(path);
+  if (!metadata) {
+    return "stat: cannot stat '" + args[0] + "': No such file or directory";
+  }
+
+  std::string result = "File: " + path + "\nType: " +
+                       (isDirectory ? "directory" : "regular file") +
+                       "\nSize: " + std::to_string(metadata->size);
+  if (isDirectory) {
+    DirectoryTotals totals = vfs->getTotalsFromStorage(path);
+    result += "\nTotal: " + std::to_string(totals.bytes) +
+              "\nFiles: " + std::to_string(totals.files) +
+              "\nDirectories: " + std::to_string(totals.directories);
+  }
+  return result;
+}
+
+CompactCommand::CompactCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string CompactCommand::execute(const std::vector<std::string> &args) {
+  if (!args.empty()) {
+    return "compact: too many arguments";
+  }
+
+  try {
+    uint64_t reclaimed = vfs->compact();
+    return "compact: reclaimed " + std::to_string(reclaimed) + " bytes";
+  } catch (const std::exception &e) {
+    return std::string("compact: ") + e.what();
+  }
+}
+
+std::string formatImportSummary(const ImportSummary &summary) {
+  std::string result = "import: " + std::to_string(summary.files) +
+                       " files, " + std::to_string(summary.directories) +
+                       " directories, " + std::to_string(summary.bytes) +
+                       " bytes";
+  if (summary.deduplicated > 0) {
+    result += ", " + std::to_string(summary.deduplicated) + " deduplicated";
+  }
+  if (summary.skipped > 0) {
+    result += ", " + std::to_string(summary.skipped) + " skipped";
+  }
+  return result;
+}
+
+ImportCommand::ImportCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string ImportCommand::execute(const std::vector<std::string> &args) {
+  if (args.empty()) {
+    return "import: missing host directory operand";
+  }
+  if (args.size() > 2) {
+    return "import: too many arguments";
+  }
+
+  try {
+    ImportSummary summary = vfs->importDirectory(
+        args[0], args.size() == 2 ? args[1] : vfs->getCurrentDirectory());
+    return formatImportSummary(summary);
+  } catch (const std::exception &e) {
+    return std::string("import: ") + e.what();
+  }
+}
+
+std::string formatExportSummary(const ExportSummary &summary) {
+  return "export: " + std::to_string(summary.files) + " files, " +
+         std::to_string(summary.directories) + " directories, " +
+         std::to_string(summary.bytes) + " bytes";
+}
+
+ExportCommand::ExportCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string ExportCommand::execute(const std::vector<std::string> &args) {
+  if (args.size() < 2) {
+    return "export: missing operand";
+  }
+  if (args.size() > 2) {
+    return "export: too many arguments";
+  }
+
+  try {
+    return formatExportSummary(vfs->exportDirectory(args[0], args[1]));
+  } catch (const std::exception &e) {
+    return std::string("export: ") + e.what();
+  }
+}
+
+CatCommand::CatCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string CatCommand::execute(const std::vector<std::string> &args) {
+  if (args.empty()) {
+    return "cat: missing operand";
+  }
+
+  std::string result;
+  for (const std::string &path : args) {
+    std::string errorMessage;
+    try {
+      result += vfs->readFile(path, errorMessage);
+    } catch (const std::exception &e) {
+      errorMessage = e.what();
+    }
+    if (!errorMessage.empty()) {
+      return result + "cat: " + path + ": " + errorMessage;
+    }
+  }
+  return result;
+}
+
+CacheCommand::CacheCommand(std::shared_ptr<VirtualFilesystem> vfs)
+    : vfs(std::move(vfs)) {}
+
+std::string CacheCommand::execute(const std::vector<std::string> &args) {
+  if (!args.empty()) {
+    return "cache: too many arguments";
+  }
+
+  BlockCacheStats stats = vfs->getCacheStats();
+  uint64_t requests = stats.hits + stats.misses;
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  out << "Cached: " << stats.bytes / 1024 << " KiB of "
+      << stats.budget / 1024 << " KiB\n";
+  out << "Hits: " << stats.hits << " of " << requests << " blocks ("
+      << (requests == 0 ? 0.0 : 100.0 * stats.hits / requests) << "%)\n";
+  out << "Read-ahead: " << stats.readAheadHits << " of " << stats.readAhead
+      << " blocks used ("
+      << (stats.readAhead == 0 ? 0.0
+                               : 100.0 * stats.readAheadHits / stats.readAhead)
+      << "%)\n";
+  out << "Promoted: " << stats.ghostHits << "\n";
+  out << "Evictions: " << stats.evictions;
+  return out.str();
+}
+
+StatsCommand::StatsCommand(
+    std::shared_ptr<instrumentation::CommandMetrics> metrics)
+    : metrics(std::move(metrics)) {}
+
+std::string StatsCommand::execute(const std::vector<std::string> &args) {
+  if (args.empty()) {
+    return metrics->report();
+  }
+  if (args.size() == 1 && args[0] == "reset") {
+    metrics->reset();
+    return "";
+  }
+  if (args.size() == 1 && args[0] == "json") {
+    return metrics->toJson();
+  }
+  return "stats: usage: stats [reset|json]";
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include "core/block_cache.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+constexpr size_t kInitialReadAhead = 4;
+constexpr size_t kMaxReadAhead = 64;
+} // namespace
+
+BlockCache::BlockCache(uint64_t budget)
+    : budget(budget), bytes(0), probationBytes(0),
+      nextSequential(~uint64_t{0}), readAheadWindow(kInitialReadAhead) {}
+
+size_t BlockCache::read(uint64_t offset, size_t length, char *out,
+                        const Loader &loader) {
+  if (length == 0) {
+    return 0;
+  }
+  uint64_t first = offset / kBlockSize;
+  uint64_t last = (offset + length - 1) / kBlockSize;
+  uint64_t end = offset + length;
+
+  size_t ahead = 0;
+  if (first == nextSequential) {
+    if (blocks.find(last + 1) == blocks.end()) {
+      ahead = std::min(readAheadWindow, maxReadAhead());
+      readAheadWindow = std::min(readAheadWindow * 2, kMaxReadAhead);
+    }
+  } else {
+    readAheadWindow = kInitialReadAhead;
+  }
+  nextSequential = end / kBlockSize;
+
+  // Copies the requested part of block `index`.
+  auto copy = [&](uint64_t index, const char *data, size_t size) {
+    uint64_t blockStart = index * kBlockSize;
+    uint64_t from = std::max(offset, blockStart);
+    uint64_t to = std::min(end, blockStart + size);
+    if (to <= from) {
+      return size_t{0};
+    }
+    std::memcpy(out + (from - offset), data + (from - blockStart), to - from);
+    return static_cast<size_t>(to - from);
+  };
+
+  size_t copied = 0;
+  uint64_t index = first;
+  while (index <= last) {
+    auto block = blocks.find(index);
+    if (block != blocks.end()) {
+      ++counters.hits;
+      if (block->second.prefetched) {
+        ++counters.readAheadHits;
+        block->second.prefetched = false;
+      }
+      if (block->second.queue == Queue::PROTECTED) {
+        protectedBlocks.splice(protectedBlocks.begin(), protectedBlocks,
+                               block->second.position);
+      }
+      copied += copy(index, block->second.data.get(), block->second.size);
+      if (block->second.size < kBlockSize) {
+        return copied;
+      }
+      ++index;
+      continue;
+    }
+
+    // Load the whole run of missing blocks, plus the read-ahead window when
+    // the run reaches the end of the request, with a single call.
+    uint64_t runEnd = index;
+    while (runEnd <= last && blocks.find(runEnd) == blocks.end()) {
+      ++runEnd;
+    }
+    uint64_t count = runEnd - index + (runEnd > last ? ahead : 0);
+    counters.misses += runEnd - index;
+    std::unique_ptr<char[]> buffer(new char[count * kBlockSize]);
+    size_t loaded = loader(buffer.get(), count * kBlockSize,
+                           index * kBlockSize);
+    for (uint64_t i = 0; i < count && i * kBlockSize < loaded; ++i) {
+      uint64_t blockIndex = index + i;
+      const char *data = buffer.get() + i * kBlockSize;
+      size_t size = std::min<uint64_t>(kBlockSize, loaded - i * kBlockSize);
+      if (blockIndex <= last) {
+        copied += copy(blockIndex, data, size);
+      } else if (blocks.find(blockIndex) != blocks.end()) {
+        continue;
+      } else {
+        ++counters.readAhead;
+      }
+      std::unique_ptr<char[]> blockData(new char[size]);
+      std::memcpy(blockData.get(), data, size);
+      insert(blockIndex, std::move(blockData), size, blockIndex > last);
+    }
+    if (loaded < (runEnd - index) * kBlockSize) {
+      return copied;
+    }
+    index = runEnd;
+  }
+  return copied;
+}
+
+void BlockCache::insert(uint64_t index, std::unique_ptr<char[]> data,
+                        size_t size, bool prefetched) {
+  Queue queue = Queue::PROBATION;
+  auto ghost = ghostIndex.find(index);
+  if (ghost != ghostIndex.end() && !prefetched) {
+    ++counters.ghostHits;
+    ghosts.erase(ghost->second);
+    ghostIndex.erase(ghost);
+    queue = Queue::PROTECTED;
+  }
+
+  std::list<uint64_t> &list =
+      queue == Queue::PROBATION ? probation : protectedBlocks;
+  list.push_front(index);
+  blocks[index] = Block{std::move(data), size, queue, list.begin(), prefetched};
+  bytes += size;
+  if (queue == Queue::PROBATION) {
+    probationBytes += size;
+  }
+  evict();
+}
+
+void BlockCache::remove(std::unordered_map<uint64_t, Block>::iterator block) {
+  bytes -= block->second.size;
+  if (block->second.queue == Queue::PROBATION) {
+    probationBytes -= block->second.size;
+    probation.erase(block->second.position);
+  } else {
+    protectedBlocks.erase(block->second.position);
+  }
+  blocks.erase(block);
+}
+
+void BlockCache::evict() {
+  // Probation keeps a quarter of the budget; the ghost queue remembers half
+  // a budget's worth of blocks evicted from it.
+  size_t maxGhosts = budget / 2 / kBlockSize;
+  while (bytes > budget) {
+    ++counters.evictions;
+    if (!probation.empty() &&
+        (probationBytes > budget / 4 || protectedBlocks.empty())) {
+      uint64_t victim = probation.back();
+      remove(blocks.find(victim));
+      if (maxGhosts > 0 && ghostIndex.find(victim) == ghostIndex.end()) {
+        ghosts.push_front(victim);
+        ghostIndex[victim] = ghosts.begin();
+      }
+    } else {
+      remove(blocks.find(protectedBlocks.back()));
+    }
+  }
+  while (ghosts.size() > maxGhosts) {
+    ghostIndex.erase(ghosts.back());
+    ghosts.pop_back();
+  }
+}
+
+void BlockCache::invalidateFrom(uint64_t offset) {
+  uint64_t first = offset / kBlockSize;
+  for (auto block = blocks.begin(); block != blocks.end();) {
+    auto current = block++;
+    if (current->first >= first) {
+      remove(current);
+    }
+  }
+  for (auto ghost = ghosts.begin(); ghost != ghosts.end();) {
+    if (*ghost >= first) {
+      ghostIndex.erase(*ghost);
+      ghost = ghosts.erase(ghost);
+    } else {
+      ++ghost;
+    }
+  }
+  nextSequential = ~uint64_t{0};
+}
+
+void BlockCache::clear() {
+  blocks.clear();
+  probation.clear();
+  protectedBlocks.clear();
+  ghosts.clear();
+  ghostIndex.clear();
+  bytes = 0;
+  probationBytes = 0;
+  nextSequential = ~uint64_t{0};
+}
+
+void BlockCache::setBudget(uint64_t budget) {
+  this->budget = budget;
+  evict();
+}
+
+BlockCacheStats BlockCache::stats() const {
+  BlockCacheStats stats = counters;
+  stats.bytes = bytes;
+  stats.budget = budget;
+  return stats;
+}
+
+// At most a quarter of the budget goes to blocks nobody asked for yet.
+size_t BlockCache::maxReadAhead() const {
+  return std::min<uint64_t>(kMaxReadAhead, budget / 4 / kBlockSize);
+}
@@ -1,9 +1,43 @@
 #include "core/file_storage.hpp"
+#include "core/instrumentation.hpp"
+#include <algorithm>
 #include <iostream>
 
+namespace {
+std::string parentOf(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos || path == "/") {
+    return "";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+DirectoryTotals totalsOf(size_t size, FileType fileType) {
+  DirectoryTotals totals;
+  totals.bytes = size;
+  (fileType == FileType::DIR ? totals.directories : totals.files) = 1;
+  return totals;
+}
+} // namespace
+
+DirectoryTotals &DirectoryTotals::operator+=(const DirectoryTotals &other) {
+  bytes += other.bytes;
+  files += other.files;
+  directories += other.directories;
+  return *this;
+}
+
+DirectoryTotals &DirectoryTotals::operator-=(const DirectoryTotals &other) {
+  bytes -= other.bytes;
+  files -= other.files;
+  directories -= other.directories;
+  return *this;
+}
+
 FileStorage::FileStorage() { add("/", 0, FileType::DIR); }
 
-void FileStorage::add(const std::string &path, size_t size, FileType fileType) {
+void FileStorage::add(const std::string &path, size_t size, FileType fileType,
+                      uint64_t offset) {
   if (path.empty()) {
     std::cerr << "Error: Path cannot be empty.\n";
     return;
@@ -14,17 +48,46 @@ void FileStorage::add(const std::string &path, size_t size, FileType fileType) {
     adjustedPath.pop_back();
   }
 
-  if (files.find(adjustedPath) != files.end()) {
+  if (exists(adjustedPath)) {
     std::cerr << "Error: File or directory already exists: " + adjustedPath
               << '\n';
     return;
   }
 
-  files[adjustedPath] = Metadata(adjustedPath, size, fileType);
+  materialize(parentOf(adjustedPath));
+  insert(adjustedPath, size, fileType, offset);
+  addToAncestors(adjustedPath, totalsOf(size, fileType));
+}
+
+void FileStorage::addBatch(const std::vector<Metadata> &entries) {
+  std::unordered_map<std::string, DirectoryTotals> parentTotals;
+  std::string lastParent;
+  for (const Metadata &metadata : entries) {
+    std::string parent = parentOf(metadata.path);
+    if (parent != lastParent) {
+      materialize(parent);
+      lastParent = parent;
+    }
+    insert(metadata.path, metadata.size, metadata.fileType, metadata.offset);
+    parentTotals[parent] += totalsOf(metadata.size, metadata.fileType);
+  }
+
+  for (const auto &[parent, totals] : parentTotals) {
+    for (std::string ancestor = parent; !ancestor.empty();
+         ancestor = parentOf(ancestor)) {
+      totalsDeltas[ancestor] += totals;
+    }
+  }
 }
 
 bool FileStorage::remove(const std::string &path) {
-  if (files.erase(path) == 1) {
+  std::string parent = parentOf(path);
+  materialize(parent);
+  auto it = files.find(path);
+  if (it != files.end()) {
+    removeFromAncestors(path, totalsOf(it->second.size, it->second.fileType));
+    files.erase(it);
+    children[parent].erase(path.substr(path.find_last_of('/') + 1));
     return true;
   } else {
     std::cerr << "File or directory not found: " << path << std::endl;
@@ -33,13 +96,266 @@ bool FileStorage::remove(const std::string &path) {
 }
 
 bool FileStorage::exists(const std::string &path) const {
-  return files.find(path) != files.end();
+  instrumentation::storageLookups.fetch_add(1, std::memory_order_relaxed);
+  if (files.find(path) != files.end()) {
+    return true;
+  }
+  return materialized.count(parentOf(path)) == 0 && findLazy(path) != nullptr;
 }
 
 const Metadata &FileStorage::getMetadata(const std::string &path) const {
+  instrumentation::storageLookups.fetch_add(1, std::memory_order_relaxed);
+  materialize(parentOf(path));
   auto it = files.find(path);
   if (it == files.end()) {
     throw std::runtime_error("File or directory not found: " + path);
   }
   return it->second;
 }
+
+const std::set<std::string> &
+FileStorage::listChildren(const std::string &path) const {
+  static const std::set<std::string> noChildren;
+  materialize(path);
+  auto it = children.find(path);
+  return it == children.end() ? noChildren : it->second;
+}
+
+DirectoryTotals FileStorage::getTotals(const std::string &path) const {
+  instrumentation::storageLookups.fetch_add(1, std::memory_order_relaxed);
+  auto cached = lazyTotals.find(path);
+  if (cached == lazyTotals.end()) {
+    // The subtree of a directory is one contiguous range of the sorted
+    // table: [path + "/", path + "0").
+    const std::string prefix = path == "/" ? "/" : path + "/";
+    const std::string end = path == "/" ? "0" : path + "0";
+    auto lowerBound = [this](const std::string &key) {
+      return std::lower_bound(lazyEntries.begin(), lazyEntries.end(), key,
+                              [this](const LazyEntry &entry,
+                                     const std::string &key) {
+                                return lazyPath(entry) < key;
+                              }) -
+             lazyEntries.begin();
+    };
+    size_t first = lowerBound(prefix);
+    size_t last = lowerBound(end);
+    if (first < last && lazyPath(lazyEntries[first]) == "/") {
+      ++first;
+    }
+
+    DirectoryTotals totals;
+    if (first < last) {
+      totals += lazyPrefixTotals[last];
+      totals -= lazyPrefixTotals[first];
+    }
+    cached = lazyTotals.emplace(path, totals).first;
+  }
+
+  DirectoryTotals totals = cached->second;
+  auto delta = totalsDeltas.find(path);
+  if (delta != totalsDeltas.end()) {
+    totals += delta->second;
+  }
+  return totals;
+}
+
+void FileStorage::setOffset(const std::string &path, uint64_t offset) {
+  auto it = files.find(path);
+  if (it != files.end()) {
+    it->second.offset = offset;
+  }
+  // Keep the table in step as well, for when the parent is materialized.
+  if (const LazyEntry *entry = findLazy(path)) {
+    lazyEntries[entry - lazyEntries.data()].offset = offset;
+  }
+}
+
+void FileStorage::addToAncestors(const std::string &path,
+                                 const DirectoryTotals &delta) {
+  for (std::string ancestor = parentOf(path); !ancestor.empty();
+       ancestor = parentOf(ancestor)) {
+    totalsDeltas[ancestor] += delta;
+  }
+}
+
+void FileStorage::removeFromAncestors(const std::string &path,
+                                      const DirectoryTotals &delta) {
+  for (std::string ancestor = parentOf(path); !ancestor.empty();
+       ancestor = parentOf(ancestor)) {
+    totalsDeltas[ancestor] -= delta;
+  }
+}
+
+void FileStorage::addLazy(const std::string &path, size_t size,
+                          FileType fileType, uint64_t offset) {
+  std::string_view adjustedPath = path;
+  if (fileType == FileType::DIR && adjustedPath.size() > 1 &&
+      adjustedPath.back() == '/') {
+    adjustedPath.remove_suffix(1);
+  }
+  lazyEntries.push_back({lazyPaths.size(),
+                         static_cast<uint32_t>(adjustedPath.size()), fileType,
+                         size, offset});
+  lazyPaths.append(adjustedPath);
+}
+
+void FileStorage::addLazyLink(const std::string &path,
+                              const std::string &target, uint64_t offset) {
+  lazyLinks.push_back({lazyPaths.size(), static_cast<uint32_t>(path.size()),
+                       target, offset});
+  lazyPaths.append(path);
+}
+
+size_t FileStorage::sealLazy() {
+  std::stable_sort(lazyEntries.begin(), lazyEntries.end(),
+                   [this](const LazyEntry &a, const LazyEntry &b) {
+                     return lazyPath(a) < lazyPath(b);
+                   });
+  if (!lazyLinks.empty()) {
+    resolveLazyLinks();
+  }
+
+  // Of equal paths the stable sort leaves the latest entry last.
+  auto last = std::unique(lazyEntries.rbegin(), lazyEntries.rend(),
+                          [this](const LazyEntry &a, const LazyEntry &b) {
+                            return lazyPath(a) == lazyPath(b);
+                          });
+  size_t superseded = lazyEntries.size() - (last - lazyEntries.rbegin());
+  lazyEntries.erase(lazyEntries.begin(), last.base());
+  lazyEntries.shrink_to_fit();
+
+  lazyPrefixTotals.assign(lazyEntries.size() + 1, DirectoryTotals());
+  for (size_t i = 0; i < lazyEntries.size(); ++i) {
+    lazyPrefixTotals[i + 1] = lazyPrefixTotals[i];
+    lazyPrefixTotals[i + 1] +=
+        totalsOf(lazyEntries[i].size, lazyEntries[i].fileType);
+  }
+  lazyTotals.clear();
+  return superseded;
+}
+
+void FileStorage::resolveLazyLinks() {
+  // Resolved links join the table ordered by their own position so that
+  // "last entry wins" still follows archive order; their payload offsets are
+  // put back once the table is sorted.
+  std::unordered_map<uint64_t, uint64_t> payloadOffsets;
+  std::unordered_map<std::string_view, std::vector<LazyEntry>> resolved;
+  size_t sortedEntries = lazyEntries.size();
+  for (const LazyLink &link : lazyLinks) {
+    // Links only ever point backwards, possibly at earlier links. Until the
+    // fix-up below every entry's offset is also its position.
+    const LazyEntry *target = nullptr;
+    auto it = std::lower_bound(lazyEntries.begin(),
+                               lazyEntries.begin() + sortedEntries,
+                               link.target,
+                               [this](const LazyEntry &entry,
+                                      const std::string &key) {
+                                 return lazyPath(entry) < key;
+                               });
+    for (; it != lazyEntries.begin() + sortedEntries &&
+           lazyPath(*it) == link.target && it->offset < link.offset;
+         ++it) {
+      target = &*it;
+    }
+    auto linked = resolved.find(link.target);
+    if (linked != resolved.end()) {
+      for (const LazyEntry &entry : linked->second) {
+        if (entry.offset < link.offset &&
+            (target == nullptr || entry.offset > target->offset)) {
+          target = &entry;
+        }
+      }
+    }
+
+    LazyEntry entry{link.pathOffset, link.pathLength, FileType::REG, 0,
+                    link.offset};
+    if (target != nullptr) {
+      auto payload = payloadOffsets.find(target->pathOffset);
+      entry.size = target->size;
+      payloadOffsets[link.pathOffset] =
+          payload != payloadOffsets.end() ? payload->second : target->offset;
+    }
+    resolved[lazyPath(entry)].push_back(entry);
+    lazyEntries.push_back(entry);
+  }
+  lazyLinks.clear();
+  lazyLinks.shrink_to_fit();
+
+  auto byPathAndOffset = [this](const LazyEntry &a, const LazyEntry &b) {
+    int order = lazyPath(a).compare(lazyPath(b));
+    return order < 0 || (order == 0 && a.offset < b.offset);
+  };
+  std::sort(lazyEntries.begin() + sortedEntries, lazyEntries.end(),
+            byPathAndOffset);
+  std::inplace_merge(lazyEntries.begin(),
+                     lazyEntries.begin() + sortedEntries, lazyEntries.end(),
+                     byPathAndOffset);
+  for (LazyEntry &entry : lazyEntries) {
+    auto payload = payloadOffsets.find(entry.pathOffset);
+    if (payload != payloadOffsets.end()) {
+      entry.offset = payload->second;
+    }
+  }
+}
+
+std::string_view FileStorage::lazyPath(const LazyEntry &entry) const {
+  return std::string_view(lazyPaths).substr(entry.pathOffset,
+                                            entry.pathLength);
+}
+
+const FileStorage::LazyEntry *
+FileStorage::findLazy(const std::string &path) const {
+  auto it = std::lower_bound(lazyEntries.begin(), lazyEntries.end(), path,
+                             [this](const LazyEntry &entry,
+                                    const std::string &key) {
+                               return lazyPath(entry) < key;
+                             });
+  if (it == lazyEntries.end() || lazyPath(*it) != path) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+void FileStorage::materialize(const std::string &directory) const {
+  if (!materialized.insert(directory).second || lazyEntries.empty()) {
+    return;
+  }
+
+  const std::string prefix = directory == "/" ? "/" : directory + "/";
+  auto lowerBound = [this](auto first, const std::string &key) {
+    return std::lower_bound(first, lazyEntries.end(), key,
+                            [this](const LazyEntry &entry,
+                                   const std::string &key) {
+                              return lazyPath(entry) < key;
+                            });
+  };
+
+  // Direct children are interleaved with their subtrees; skip each subtree
+  // with one binary search instead of walking it.
+  auto it = lowerBound(lazyEntries.begin(), prefix);
+  while (it != lazyEntries.end()) {
+    std::string_view path = lazyPath(*it);
+    if (path.compare(0, prefix.size(), prefix) != 0) {
+      break;
+    }
+    std::string_view name = path.substr(prefix.size());
+    size_t slash = name.find('/');
+    if (slash == std::string_view::npos) {
+      if (!name.empty() && files.find(std::string(path)) == files.end()) {
+        insert(std::string(path), it->size, it->fileType, it->offset);
+      }
+      ++it;
+    } else {
+      // '0' sorts right after '/', so this is the end of the subtree.
+      it = lowerBound(it, prefix + std::string(name.substr(0, slash)) + '0');
+    }
+  }
+}
+
+void FileStorage::insert(const std::string &path, size_t size,
+                         FileType fileType, uint64_t offset) const {
+  files[path] = Metadata(path, size, fileType, offset);
+  if (path != "/") {
+    children[parentOf(path)].insert(path.substr(path.find_last_of('/') + 1));
+  }
+}
@@ -0,0 +1,105 @@
+#include "core/file_watcher.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <stdexcept>
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace {
+// Writes closer together than this are reported once.
+constexpr int kCoalesceMilliseconds = 50;
+constexpr uint32_t kWatchedEvents =
+    IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+} // namespace
+
+FileWatcher::FileWatcher(const std::string &path,
+                         std::function<void()> onChange)
+    : onChange(std::move(onChange)) {
+  std::filesystem::path file = std::filesystem::absolute(path);
+  name = file.filename().string();
+  inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotifyFd < 0) {
+    throw std::runtime_error("Failed to start watching " + path + ": " +
+                             std::strerror(errno));
+  }
+  if (inotify_add_watch(inotifyFd, file.parent_path().c_str(),
+                        kWatchedEvents) < 0) {
+    std::string error = std::strerror(errno);
+    close(inotifyFd);
+    throw std::runtime_error("Failed to watch " + path + ": " + error);
+  }
+  stopFd = eventfd(0, EFD_CLOEXEC);
+  if (stopFd < 0) {
+    close(inotifyFd);
+    throw std::runtime_error("Failed to start watching " + path);
+  }
+  thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher() {
+  uint64_t stop = 1;
+  [[maybe_unused]] ssize_t written = write(stopFd, &stop, sizeof(stop));
+  thread.join();
+  close(stopFd);
+  close(inotifyFd);
+}
+
+void FileWatcher::run() {
+  alignas(struct inotify_event) char buffer[4096];
+  pollfd descriptors[] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+  bool changed = false;
+  std::chrono::steady_clock::time_point deadline;
+  while (true) {
+    // Once something changed, further events are gathered until a fixed
+    // deadline. It is not pushed back by later events, so a steady stream of
+    // writes, or of events for other files in the directory, cannot hold the
+    // report back.
+    int timeout = -1;
+    if (changed) {
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      timeout = std::max<int>(0, remaining.count());
+    }
+    int ready = poll(descriptors, 2, timeout);
+    if (ready < 0 && errno != EINTR) {
+      return;
+    }
+    if (ready > 0 && descriptors[1].revents != 0) {
+      return;
+    }
+    if (changed && std::chrono::steady_clock::now() >= deadline) {
+      changed = false;
+      onChange();
+    }
+    if (ready <= 0 || descriptors[0].revents == 0) {
+      continue;
+    }
+    ssize_t length;
+    while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+      for (char *at = buffer; at < buffer + length;) {
+        const auto *event = reinterpret_cast<const struct inotify_event *>(at);
+        if (event->len > 0 && name == event->name && !changed) {
+          changed = true;
+          deadline = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(kCoalesceMilliseconds);
+        }
+        at += sizeof(struct inotify_event) + event->len;
+      }
+    }
+  }
+}
+#else
+FileWatcher::FileWatcher(const std::string &,
+                         std::function<void()> onChange)
+    : onChange(std::move(onChange)) {}
+
+FileWatcher::~FileWatcher() = default;
+#endif
@@ -1,11 +1,16 @@
 #include "core/gui_shell.hpp"
 #include "core/parser.hpp"
 #include "core/virtual_filesystem.hpp"
+#include <chrono>
+#include <iostream>
 #include <memory>
 
-GUIShell::GUIShell(std::shared_ptr<VirtualFilesystem> vfs)
-    : vfs(vfs), fm(nana::form{}), input_box(fm), output_box(fm) {
-  parser = std::make_unique<Parser>(vfs);
+GUIShell::GUIShell(std::shared_ptr<VirtualFilesystem> vfs,
+                   std::shared_ptr<instrumentation::CommandMetrics> metrics,
+                   const std::string &historyPath)
+    : vfs(vfs), history(historyPath), fm(nana::form{}), input_box(fm),
+      output_box(fm), search_label(fm) {
+  parser = std::make_unique<Parser>(vfs, std::move(metrics));
   fm.caption("Shell by Yakov");
   fm.size({600, 400});
 
@@ -14,22 +19,164 @@ GUIShell::GUIShell(std::shared_ptr<VirtualFilesystem> vfs)
 
   input_box.multi_lines(false);
   input_box.events().key_press([this](const nana::arg_keyboard &arg) {
+    if (arg.ctrl && (arg.key == 'R' || arg.key == 'r')) {
+      arg.ignore = true;
+      if (!search) {
+        search = std::make_unique<HistorySearch>(history);
+        input_box.caption("");
+        on_search(std::nullopt);
+      } else if (auto older = search->older()) {
+        on_search(older);
+      }
+      return;
+    }
+    if (search) {
+      if (arg.key == nana::keyboard::enter) {
+        arg.ignore = true;
+        end_search(true);
+        return;
+      }
+      if (arg.key == nana::keyboard::escape) {
+        end_search(false);
+        return;
+      }
+      // The arrows only leave the search; stepping the history as well
+      // would replace the match just accepted.
+      if (arg.key == nana::keyboard::os_arrow_up ||
+          arg.key == nana::keyboard::os_arrow_down) {
+        arg.ignore = true;
+        end_search(true);
+        return;
+      }
+    }
     if (arg.key == nana::keyboard::enter) {
       on_execute();
+    } else if (arg.key == nana::keyboard::tab) {
+      arg.ignore = true;
+      on_complete();
+    } else if (arg.key == nana::keyboard::os_arrow_up) {
+      arg.ignore = true;
+      on_history(history.previous());
+    } else if (arg.key == nana::keyboard::os_arrow_down) {
+      arg.ignore = true;
+      on_history(history.next());
+    }
+  });
+  // Keeps Tab and Ctrl+R from being typed into the box or moving the focus.
+  input_box.events().key_char([](const nana::arg_keyboard &arg) {
+    if (arg.key == nana::keyboard::tab || arg.key == 0x12) {
+      arg.ignore = true;
+    }
+  });
+  input_box.events().text_changed([this](const nana::arg_textbox &) {
+    if (search) {
+      on_search(search->update(input_box.text()));
     }
   });
 
-  fm.div("vert <output height=90%><input height=10%>");
+  fm.div("vert <output height=90%><search weight=20><input height=10%>");
   fm["output"] << output_box;
+  fm["search"] << search_label;
   fm["input"] << input_box;
   fm.collocate();
 }
 
+GUIShell::~GUIShell() {
+  // The watcher calls back into this shell.
+  vfs->watchArchive(nullptr);
+}
+
+void GUIShell::watchArchive() {
+  // Watching is optional; running out of inotify watches must not keep the
+  // shell from starting.
+  try {
+    vfs->watchArchive([this](size_t merged) {
+      appendedEntries.fetch_add(merged, std::memory_order_relaxed);
+    });
+  } catch (const std::exception &e) {
+    std::cerr << "Not watching the archive: " << e.what() << std::endl;
+    return;
+  }
+  archive_timer.interval(std::chrono::milliseconds(250));
+  archive_timer.elapse([this] { on_archive_changed(); });
+  archive_timer.start();
+}
+
 void GUIShell::run() {
   fm.show();
   nana::exec();
 }
 
+void GUIShell::on_complete() {
+  const auto input = input_box.text();
+  std::vector<std::string> candidates;
+  const std::string completed = parser->complete(input, candidates);
+  if (completed != input) {
+    input_box.caption(completed);
+    input_box.caret_pos({static_cast<unsigned>(completed.size()), 0});
+    return;
+  }
+  if (candidates.size() > 1) {
+    std::string listing;
+    for (const auto &candidate : candidates) {
+      listing += candidate + "\n";
+    }
+    output_box.append(listing, true);
+  }
+}
+
+void GUIShell::on_history(std::optional<std::string_view> line) {
+  if (!line) {
+    return;
+  }
+  input_box.caption(std::string(*line));
+  input_box.caret_pos({static_cast<unsigned>(line->size()), 0});
+}
+
+void GUIShell::on_search(std::optional<std::string_view> match) {
+  const auto query = input_box.text();
+  if (match || query.empty()) {
+    searchMatch = match ? std::string(*match) : "";
+    search_label.caption("(reverse-i-search)`" + query + "': " + searchMatch);
+  } else {
+    searchMatch.clear();
+    search_label.caption("(failed reverse-i-search)`" + query + "'");
+  }
+}
+
+// Reports entries appended to the archive from outside and shows the last
+// ls or tree again so it reflects them.
+void GUIShell::on_archive_changed() {
+  size_t merged = appendedEntries.exchange(0, std::memory_order_relaxed);
+  if (merged == 0) {
+    return;
+  }
+  std::string report = "-- " + std::to_string(merged) +
+                       " entries appended to the archive --\n";
+  if (!lastListing.empty()) {
+    try {
+      std::string result = parser->refreshCommand(lastListing);
+      report += "> " + vfs->getCurrentDirectory() + " $ " + lastListing +
+                "\n" + result +
+                (result.empty() || result.back() == '\n' ? "" : "\n");
+    } catch (const std::exception &e) {
+      report += std::string(e.what()) + "\n";
+    }
+  }
+  output_box.append(report, true);
+}
+
+// Leaves Ctrl+R search. Accepting puts the match in the input box for
+// editing; otherwise the query stays there as typed.
+void GUIShell::end_search(bool accept) {
+  search.reset();
+  search_label.caption("");
+  if (accept && !searchMatch.empty()) {
+    on_history(searchMatch);
+  }
+  searchMatch.clear();
+}
+
 void GUIShell::on_execute() {
   const auto command = input_box.text();
   input_box.caption("");
@@ -39,14 +186,21 @@ void GUIShell::on_execute() {
     msg.show();
     return;
   }
+  history.add(command);
   if (command == "exit") {
     fm.close();
     return;
   }
   if (command == "clear") {
     output_box.caption("");
+    lastListing.clear();
     return;
   }
+  std::string_view commandName(command);
+  commandName = commandName.substr(0, commandName.find(' '));
+  if (commandName == "ls" || commandName == "tree") {
+    lastListing = command;
+  }
   try {
     std::string currentDir = vfs->getCurrentDirectory();
     std::string prompt = currentDir + " $ ";
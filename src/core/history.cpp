@@ -0,0 +1,281 @@
+#include "core/history.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+History::History(const std::string &path)
+    : file(nullptr), mapped(nullptr), mappedSize(0), lineStarts{0},
+      addedStarts{0}, cursor(0) {
+  if (path.empty()) {
+    return;
+  }
+  load(path);
+  file = std::fopen(path.c_str(), "ab");
+  if (file == nullptr) {
+    throw std::runtime_error("Failed to open history: " + path);
+  }
+  // A session that died mid-write may have left the last line unterminated;
+  // start the next one on a line of its own.
+  if (mappedSize > 0 && mapped[mappedSize - 1] != '\n') {
+    std::fputc('\n', file);
+    std::fflush(file);
+  }
+}
+
+History::~History() {
+  if (file != nullptr) {
+    std::fclose(file);
+  }
+#ifndef _WIN32
+  if (mapped != nullptr) {
+    munmap(const_cast<char *>(mapped), mappedSize);
+  }
+#endif
+}
+
+void History::load(const std::string &path) {
+#ifdef _WIN32
+  std::ifstream stream(path, std::ios::binary);
+  contents.assign(std::istreambuf_iterator<char>(stream),
+                  std::istreambuf_iterator<char>());
+  mapped = contents.data();
+  mappedSize = contents.size();
+#else
+  int descriptor = open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    return;
+  }
+  struct stat status;
+  if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+    void *region = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE,
+                        descriptor, 0);
+    if (region != MAP_FAILED) {
+      mapped = static_cast<const char *>(region);
+      mappedSize = status.st_size;
+      madvise(region, mappedSize, MADV_SEQUENTIAL);
+    } else {
+      std::cerr << "history: failed to map " << path << std::endl;
+    }
+  }
+  close(descriptor);
+#endif
+
+  lineStarts.clear();
+  size_t position = 0;
+  while (position < mappedSize) {
+    lineStarts.push_back(position);
+    const void *newline =
+        std::memchr(mapped + position, '\n', mappedSize - position);
+    position = newline == nullptr
+                   ? mappedSize + 1
+                   : static_cast<const char *>(newline) - mapped + 1;
+  }
+  lineStarts.push_back(position);
+  cursor = savedLines();
+}
+
+void History::add(std::string_view command) {
+  if (command.find_first_not_of(" \t") == std::string_view::npos ||
+      (size() > 0 && at(size() - 1) == command)) {
+    reset();
+    return;
+  }
+  size_t start = added.size();
+  added.append(command);
+  std::replace(added.begin() + start, added.end(), '\n', ' ');
+  added.push_back('\n');
+  addedStarts.push_back(added.size());
+  if (file != nullptr) {
+    std::fwrite(added.data() + start, 1, added.size() - start, file);
+    std::fflush(file);
+  }
+  reset();
+}
+
+std::string_view History::at(size_t index) const {
+  if (index < savedLines()) {
+    return std::string_view(mapped + lineStarts[index],
+                            lineStarts[index + 1] - lineStarts[index] - 1);
+  }
+  index -= savedLines();
+  return std::string_view(added.data() + addedStarts[index],
+                          addedStarts[index + 1] - addedStarts[index] - 1);
+}
+
+std::optional<std::string_view> History::previous() {
+  if (cursor == 0) {
+    return std::nullopt;
+  }
+  return at(--cursor);
+}
+
+std::optional<std::string_view> History::next() {
+  if (cursor >= size()) {
+    return std::nullopt;
+  }
+  ++cursor;
+  return cursor == size() ? std::string_view() : at(cursor);
+}
+
+namespace {
+uint32_t trigramAt(const char *at) {
+  return static_cast<uint32_t>(static_cast<unsigned char>(at[0])) << 16 |
+         static_cast<uint32_t>(static_cast<unsigned char>(at[1])) << 8 |
+         static_cast<unsigned char>(at[2]);
+}
+} // namespace
+
+// Two passes over the mapping: the first counts the lines holding each
+// trigram, the second lays the lines out in one array, so the index costs a
+// single allocation besides the table of trigrams.
+void History::indexTrigrams() const {
+  auto forEachTrigram = [&](const auto &visit) {
+    for (size_t line = 0; line < savedLines(); ++line) {
+      std::string_view text = at(line);
+      for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        visit(trigramAt(text.data() + i), static_cast<uint32_t>(line));
+      }
+    }
+  };
+  constexpr uint32_t kNoLine = UINT32_MAX;
+  forEachTrigram([&](uint32_t trigram, uint32_t line) {
+    Postings &postings =
+        trigrams.try_emplace(trigram, Postings{0, 0, kNoLine}).first->second;
+    if (postings.lastLine != line) {
+      ++postings.end;
+      postings.lastLine = line;
+    }
+  });
+  uint32_t total = 0;
+  for (auto &[trigram, postings] : trigrams) {
+    postings.begin = total;
+    total += postings.end;
+    postings.end = postings.begin;
+    postings.lastLine = kNoLine;
+  }
+  trigramLines.resize(total);
+  forEachTrigram([&](uint32_t trigram, uint32_t line) {
+    Postings &postings = trigrams.find(trigram)->second;
+    if (postings.lastLine != line) {
+      trigramLines[postings.end++] = line;
+      postings.lastLine = line;
+    }
+  });
+  trigramsIndexed = true;
+}
+
+std::vector<uint32_t> History::find(std::string_view needle) const {
+  std::vector<uint32_t> matches;
+  if (needle.empty()) {
+    return matches;
+  }
+  // One substring search runs over each buffer; a hit is mapped to its line
+  // and the search resumes at the start of the next one.
+  auto scan = [&](std::string_view data, const auto &starts, size_t lines,
+                  size_t base) {
+    size_t hit = data.find(needle);
+    while (hit != std::string_view::npos) {
+      size_t line = std::upper_bound(starts.begin(), starts.end(), hit) -
+                    starts.begin() - 1;
+      matches.push_back(static_cast<uint32_t>(base + line));
+      if (line + 1 >= lines) {
+        break;
+      }
+      hit = data.find(needle, starts[line + 1]);
+    }
+  };
+
+  if (needle.size() < 3) {
+    scan(std::string_view(mapped, mappedSize), lineStarts, savedLines(), 0);
+  } else if (savedLines() > 0) {
+    if (!trigramsIndexed) {
+      indexTrigrams();
+    }
+    // Intersect the postings from the shortest up, then confirm each
+    // remaining line holds the needle itself and not just its trigrams.
+    std::vector<const Postings *> lists;
+    for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+      auto found = trigrams.find(trigramAt(needle.data() + i));
+      if (found == trigrams.end()) {
+        lists.clear();
+        break;
+      }
+      lists.push_back(&found->second);
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const Postings *a, const Postings *b) {
+                return a->end - a->begin < b->end - b->begin;
+              });
+    std::vector<uint32_t> candidates;
+    if (!lists.empty()) {
+      candidates.assign(trigramLines.begin() + lists.front()->begin,
+                        trigramLines.begin() + lists.front()->end);
+    }
+    // Longer lists are probed by galloping from where the previous
+    // candidate was found, so they are never walked in full.
+    for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+      const uint32_t *from = trigramLines.data() + lists[i]->begin;
+      const uint32_t *to = trigramLines.data() + lists[i]->end;
+      auto kept = candidates.begin();
+      for (uint32_t line : candidates) {
+        size_t step = 1;
+        while (step < static_cast<size_t>(to - from) && from[step] < line) {
+          from += step;
+          step *= 2;
+        }
+        from = std::lower_bound(
+            from, from + std::min<size_t>(step + 1, to - from), line);
+        if (from == to) {
+          break;
+        }
+        if (*from == line) {
+          *kept++ = line;
+        }
+      }
+      candidates.erase(kept, candidates.end());
+    }
+    for (uint32_t line : candidates) {
+      if (at(line).find(needle) != std::string_view::npos) {
+        matches.push_back(line);
+      }
+    }
+  }
+  scan(added, addedStarts, addedStarts.size() - 1, savedLines());
+  return matches;
+}
+
+std::optional<std::string_view>
+HistorySearch::update(const std::string &query) {
+  if (searched && !this->query.empty() &&
+      query.find(this->query) != std::string::npos) {
+    matches.erase(std::remove_if(matches.begin(), matches.end(),
+                                 [&](uint32_t index) {
+                                   return history.at(index).find(query) ==
+                                          std::string_view::npos;
+                                 }),
+                  matches.end());
+  } else {
+    matches = history.find(query);
+  }
+  this->query = query;
+  searched = true;
+  position = matches.size();
+  return older();
+}
+
+std::optional<std::string_view> HistorySearch::older() {
+  if (position == 0) {
+    return std::nullopt;
+  }
+  return history.at(matches[--position]);
+}
@@ -0,0 +1,243 @@
+#include "core/instrumentation.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace instrumentation {
+
+std::atomic<uint64_t> storageLookups{0};
+std::atomic<uint64_t> archiveBytesRead{0};
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocatedBytes{0};
+std::atomic<uint64_t> journalSyncs{0};
+
+Snapshot Snapshot::take() {
+  return {instrumentation::storageLookups.load(std::memory_order_relaxed),
+          instrumentation::archiveBytesRead.load(std::memory_order_relaxed),
+          instrumentation::allocations.load(std::memory_order_relaxed),
+          instrumentation::allocatedBytes.load(std::memory_order_relaxed)};
+}
+
+uint64_t CommandStats::percentileMicros(double quantile) const {
+  uint64_t rank = static_cast<uint64_t>(quantile * calls);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+    seen += latencyHistogram[bucket];
+    if (seen > rank) {
+      return bucket == 0 ? 1 : uint64_t(1) << bucket;
+    }
+  }
+  return maxMicros;
+}
+
+void CommandMetrics::record(const std::string &command,
+                            std::chrono::nanoseconds elapsed,
+                            const Snapshot &before, const Snapshot &after) {
+  uint64_t micros =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  size_t bucket = 0;
+  while (bucket + 1 < kLatencyBuckets && (micros >> bucket) != 0) {
+    ++bucket;
+  }
+
+  CommandStats &stats = commands[command];
+  ++stats.calls;
+  stats.totalMicros += micros;
+  stats.maxMicros = std::max(stats.maxMicros, micros);
+  ++stats.latencyHistogram[bucket];
+  stats.storageLookups += after.storageLookups - before.storageLookups;
+  stats.archiveBytesRead += after.archiveBytesRead - before.archiveBytesRead;
+  stats.allocations += after.allocations - before.allocations;
+  stats.allocatedBytes += after.allocatedBytes - before.allocatedBytes;
+}
+
+void CommandMetrics::reset() { commands.clear(); }
+
+std::string CommandMetrics::report() const {
+  std::ostringstream out;
+  out << std::left << std::setw(10) << "command" << std::right << std::setw(8)
+      << "calls" << std::setw(10) << "mean_us" << std::setw(10) << "p50_us"
+      << std::setw(10) << "p99_us" << std::setw(10) << "max_us"
+      << std::setw(10) << "lookups" << std::setw(12) << "read_bytes"
+      << std::setw(10) << "allocs" << std::setw(12) << "alloc_bytes";
+  for (const auto &[name, stats] : commands) {
+    out << '\n'
+        << std::left << std::setw(10) << name << std::right << std::setw(8)
+        << stats.calls << std::setw(10) << stats.totalMicros / stats.calls
+        << std::setw(10) << stats.percentileMicros(0.5) << std::setw(10)
+        << stats.percentileMicros(0.99) << std::setw(10) << stats.maxMicros
+        << std::setw(10) << stats.storageLookups << std::setw(12)
+        << stats.archiveBytesRead << std::setw(10) << stats.allocations
+        << std::setw(12) << stats.allocatedBytes;
+  }
+  return out.str();
+}
+
+std::string CommandMetrics::toJson() const {
+  std::ostringstream out;
+  out << "{\"commands\":{";
+  bool first = true;
+  for (const auto &[name, stats] : commands) {
+    out << (first ? "" : ",") << '"' << name << "\":{"
+        << "\"calls\":" << stats.calls
+        << ",\"total_us\":" << stats.totalMicros
+        << ",\"max_us\":" << stats.maxMicros << ",\"latency_histogram_us\":[";
+    for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+      out << (bucket == 0 ? "" : ",") << stats.latencyHistogram[bucket];
+    }
+    out << "],\"storage_lookups\":" << stats.storageLookups
+        << ",\"archive_bytes_read\":" << stats.archiveBytesRead
+        << ",\"allocations\":" << stats.allocations
+        << ",\"allocated_bytes\":" << stats.allocatedBytes << '}';
+    first = false;
+  }
+  out << "}}";
+  return out.str();
+}
+
+} // namespace instrumentation
+
+namespace {
+void count(std::size_t size) {
+  instrumentation::allocations.fetch_add(1, std::memory_order_relaxed);
+  instrumentation::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+// Like the library versions, a failed allocation gives the new handler a
+// chance to free memory and is retried until there is no handler left.
+void *allocate(std::size_t size) {
+  count(size);
+  while (true) {
+    if (void *pointer = std::malloc(size == 0 ? 1 : size)) {
+      return pointer;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void *allocateAligned(std::size_t size, std::align_val_t alignment) {
+  count(size);
+  auto align = static_cast<std::size_t>(alignment);
+  // aligned_alloc() wants a size that is a multiple of the alignment.
+  std::size_t rounded =
+      (std::max<std::size_t>(size, 1) + align - 1) & ~(align - 1);
+  while (true) {
+#ifdef _WIN32
+    void *pointer = _aligned_malloc(rounded, align);
+#else
+    void *pointer = std::aligned_alloc(align, rounded);
+#endif
+    if (pointer != nullptr) {
+      return pointer;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+} // namespace
+
+// Every form is replaced, aligned ones included, so that allocations are
+// counted whatever form a type needs and every release goes back to the
+// allocator its block came from, even under sanitizers that intercept the
+// forms left out. The variants forward to the plain and aligned pairs.
+void *operator new(std::size_t size) { return allocate(size); }
+
+void *operator new[](std::size_t size) { return allocate(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return allocate(size);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+
+void operator delete(void *pointer, std::size_t) noexcept {
+  ::operator delete(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+  ::operator delete(pointer);
+}
+
+void operator delete[](void *pointer) noexcept { ::operator delete(pointer); }
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+  ::operator delete(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+  ::operator delete(pointer);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocateAligned(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocateAligned(size, alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  try {
+    return allocateAligned(size, alignment);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &tag) noexcept {
+  return operator new(size, alignment, tag);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept {
+#ifdef _WIN32
+  _aligned_free(pointer);
+#else
+  std::free(pointer);
+#endif
+}
+
+void operator delete(void *pointer, std::size_t,
+                     std::align_val_t alignment) noexcept {
+  ::operator delete(pointer, alignment);
+}
+
+void operator delete(void *pointer, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  ::operator delete(pointer, alignment);
+}
+
+void operator delete[](void *pointer, std::align_val_t alignment) noexcept {
+  ::operator delete(pointer, alignment);
+}
+
+void operator delete[](void *pointer, std::size_t,
+                       std::align_val_t alignment) noexcept {
+  ::operator delete(pointer, alignment);
+}
+
+void operator delete[](void *pointer, std::align_val_t alignment,
+                       const std::nothrow_t &) noexcept {
+  ::operator delete(pointer, alignment);
+}
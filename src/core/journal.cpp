@@ -0,0 +1,238 @@
+#include "core/journal.hpp"
+#include "core/instrumentation.hpp"
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+uint32_t checksum(const char *data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+template <typename T> void put(std::string &out, T value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> bool get(const char *&in, const char *end, T &value) {
+  if (static_cast<size_t>(end - in) < sizeof(value)) {
+    return false;
+  }
+  std::memcpy(&value, in, sizeof(value));
+  in += sizeof(value);
+  return true;
+}
+
+void putString(std::string &out, const std::string &value) {
+  put<uint32_t>(out, value.size());
+  out += value;
+}
+
+bool getString(const char *&in, const char *end, std::string &value) {
+  uint32_t size;
+  if (!get(in, end, size) || static_cast<size_t>(end - in) < size) {
+    return false;
+  }
+  value.assign(in, size);
+  in += size;
+  return true;
+}
+
+void encode(const JournalRecord &record, std::string &out) {
+  std::string payload;
+  put<uint8_t>(payload, static_cast<uint8_t>(record.op));
+  put<uint8_t>(payload, static_cast<uint8_t>(record.fileType));
+  put<uint64_t>(payload, record.size);
+  putString(payload, record.path);
+  putString(payload, record.source);
+
+  put<uint32_t>(out, payload.size());
+  put<uint32_t>(out, checksum(payload.data(), payload.size()));
+  out += payload;
+}
+} // namespace
+
+Journal::Journal(const std::string &path)
+    : path(path), appended(0), durable(0), flushing(false) {
+  file = std::fopen(path.c_str(), "ab");
+  if (file == nullptr) {
+    throw std::runtime_error("Failed to open journal: " + path);
+  }
+}
+
+Journal::~Journal() {
+  if (file != nullptr) {
+    std::fclose(file);
+  }
+}
+
+uint64_t Journal::append(const JournalRecord &record) {
+  std::string frame;
+  encode(record, frame);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  buffer += frame;
+  return ++appended;
+}
+
+void Journal::commit(uint64_t sequence) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (durable < sequence) {
+    if (flushing) {
+      flushed.wait(lock);
+      continue;
+    }
+
+    // Become the leader for this group: everything buffered so far goes out
+    // with one write and one fsync.
+    flushing = true;
+    std::string batch;
+    batch.swap(buffer);
+    uint64_t batchEnd = appended;
+    lock.unlock();
+
+    // A reset that could not reopen the journal leaves no file to write.
+    long start = file != nullptr && std::fseek(file, 0, SEEK_END) == 0
+                     ? std::ftell(file)
+                     : -1;
+    bool ok = start >= 0 &&
+              std::fwrite(batch.data(), 1, batch.size(), file) ==
+                  batch.size() &&
+              std::fflush(file) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(file)) == 0;
+#else
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    if (!ok && start >= 0) {
+      // Cut off whatever part made it out so a retry starts on a record
+      // boundary.
+      std::error_code error;
+      std::clearerr(file);
+      std::filesystem::resize_file(path, start, error);
+    }
+
+    lock.lock();
+    flushing = false;
+    if (ok) {
+      durable = batchEnd;
+      instrumentation::journalSyncs.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      // The batch goes back in front so waiting followers retry it.
+      buffer.insert(0, batch);
+    }
+    flushed.notify_all();
+    if (!ok) {
+      throw std::runtime_error("Failed to write journal: " + path);
+    }
+  }
+}
+
+void Journal::reset(const std::vector<JournalRecord> &keep) {
+  std::unique_lock<std::mutex> lock(mutex);
+  flushed.wait(lock, [this] { return !flushing; });
+
+  // The kept records may exist nowhere else, so the new journal is made
+  // durable beside the old one and renamed over it; a crash leaves one or
+  // the other, never a truncated journal.
+  std::string kept;
+  for (const JournalRecord &record : keep) {
+    encode(record, kept);
+  }
+  std::string temporary = path + ".tmp";
+  std::FILE *replacement = std::fopen(temporary.c_str(), "wb");
+  bool ok = replacement != nullptr &&
+            std::fwrite(kept.data(), 1, kept.size(), replacement) ==
+                kept.size() &&
+            std::fflush(replacement) == 0;
+#ifdef _WIN32
+  ok = ok && _commit(_fileno(replacement)) == 0;
+  // Windows cannot replace a file that is still open.
+  if (ok && file != nullptr) {
+    std::fclose(file);
+    file = nullptr;
+  }
+#else
+  ok = ok && fsync(fileno(replacement)) == 0;
+#endif
+  std::error_code error;
+  if (ok) {
+    std::filesystem::rename(temporary, path, error);
+    ok = !error;
+  }
+  if (!ok) {
+    if (replacement != nullptr) {
+      std::fclose(replacement);
+    }
+    std::filesystem::remove(temporary, error);
+#ifdef _WIN32
+    if (file == nullptr) {
+      file = std::fopen(path.c_str(), "ab");
+    }
+#endif
+    throw std::runtime_error("Failed to rewrite journal: " + path);
+  }
+
+  // The handle that wrote the new journal keeps appending to it.
+  if (file != nullptr) {
+    std::fclose(file);
+  }
+  file = replacement;
+  buffer.clear();
+  durable = appended;
+}
+
+std::vector<JournalRecord> Journal::replay(const std::string &path) {
+  std::vector<JournalRecord> records;
+  std::FILE *input = std::fopen(path.c_str(), "rb");
+  if (input == nullptr) {
+    return records;
+  }
+
+  std::string contents;
+  char chunk[1 << 16];
+  size_t read;
+  while ((read = std::fread(chunk, 1, sizeof(chunk), input)) > 0) {
+    contents.append(chunk, read);
+  }
+  std::fclose(input);
+
+  const char *in = contents.data();
+  const char *end = in + contents.size();
+  while (static_cast<size_t>(end - in) >= kRecordHeaderSize) {
+    uint32_t size = 0, sum = 0;
+    get(in, end, size);
+    get(in, end, sum);
+    if (static_cast<size_t>(end - in) < size || checksum(in, size) != sum) {
+      break;
+    }
+
+    const char *payload = in;
+    const char *payloadEnd = in + size;
+    in = payloadEnd;
+
+    uint8_t op, fileType;
+    JournalRecord record;
+    if (!get(payload, payloadEnd, op) || !get(payload, payloadEnd, fileType) ||
+        !get(payload, payloadEnd, record.size) ||
+        !getString(payload, payloadEnd, record.path) ||
+        !getString(payload, payloadEnd, record.source) ||
+        op > static_cast<uint8_t>(JournalOp::COPY)) {
+      break;
+    }
+    record.op = static_cast<JournalOp>(op);
+    record.fileType = fileType == FileType::DIR ? FileType::DIR : FileType::REG;
+    records.push_back(std::move(record));
+  }
+  return records;
+}
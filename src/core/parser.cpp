@@ -1,17 +1,26 @@
 #include "core/parser.hpp"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <sstream>
 
-Parser::Parser(std::shared_ptr<VirtualFilesystem> vfs) {
-  commands["cd"] = std::make_unique<ChangeDirectoryCommand>(vfs);
-  commands["ls"] = std::make_unique<ListDirectoryCommand>(vfs);
-  commands["cp"] = std::make_unique<CpCommand>(vfs);
-  commands["tree"] = std::make_unique<TreeCommand>(vfs);
-  commands["find"] = std::make_unique<FindCommand>(vfs);
-}
+Parser::Parser(std::shared_ptr<VirtualFilesystem> vfs,
+               std::shared_ptr<instrumentation::CommandMetrics> metrics)
+    : vfs(vfs),
+      metrics(metrics ? std::move(metrics)
+                      : std::make_shared<instrumentation::CommandMetrics>()),
+      commands(std::move(vfs), this->metrics) {}
 
 std::string Parser::processCommand(const std::string &input) {
+  return run(input, true);
+}
+
+std::string Parser::refreshCommand(const std::string &input) {
+  return run(input, false);
+}
+
+std::string Parser::run(const std::string &input, bool record) {
   std::istringstream stream(input);
   std::string commandName;
   std::vector<std::string> args;
@@ -22,9 +31,52 @@ std::string Parser::processCommand(const std::string &input) {
     args.push_back(arg);
   }
 
-  if (commands.find(commandName) != commands.end()) {
-    return commands[commandName]->execute(args);
-  } else {
+  auto before = instrumentation::Snapshot::take();
+  auto start = std::chrono::steady_clock::now();
+  std::string result;
+  if (!commands.execute(commandName, args, result)) {
     return "Unknown command: " + commandName;
   }
-}
\ No newline at end of file
+  if (record) {
+    metrics->record(commandName, std::chrono::steady_clock::now() - start,
+                    before, instrumentation::Snapshot::take());
+  }
+  return result;
+}
+
+std::string Parser::complete(const std::string &input,
+                             std::vector<std::string> &candidates) {
+  size_t wordStart = input.find_last_of(' ') + 1;
+  size_t firstWord = input.find_first_not_of(' ');
+  const std::string word = input.substr(wordStart);
+  bool isCommand = firstWord == std::string::npos || firstWord == wordStart;
+
+  candidates.clear();
+  if (isCommand) {
+    const auto &names = Commands::sortedNames;
+    for (auto it = std::lower_bound(names.begin(), names.end(), word);
+         it != names.end() && it->substr(0, word.size()) == word; ++it) {
+      candidates.emplace_back(*it);
+    }
+  } else {
+    candidates = vfs->completePath(word);
+  }
+  if (candidates.empty()) {
+    return input;
+  }
+
+  std::string common = candidates.front();
+  for (const std::string &candidate : candidates) {
+    size_t length = 0;
+    while (length < common.size() && length < candidate.size() &&
+           common[length] == candidate[length]) {
+      ++length;
+    }
+    common.resize(length);
+  }
+  std::string completed = input.substr(0, wordStart) + common;
+  if (candidates.size() == 1 && completed.back() != '/') {
+    completed += ' ';
+  }
+  return completed;
+}
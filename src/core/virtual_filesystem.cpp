@@ -1,18 +1,251 @@
 #include "core/virtual_filesystem.hpp"
 #include "core/file_storage.hpp"
+#include "core/instrumentation.hpp"
 #include <archive.h>
+#include <algorithm>
 #include <archive_entry.h>
+#include <atomic>
+#include <deque>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr size_t kCopyBufferSize = 1 << 20;
+constexpr size_t kTarTrailerSize = 1024;
+constexpr size_t kMaxPendingRecords = 4096;
+constexpr int kImportBlockSize = 1 << 20;
+constexpr uint64_t kImportQueueBytes = 256 << 20;
+constexpr uint64_t kMaxBufferedFileSize = 64 << 20;
+// Content of files added without any, zero-padded to their size.
+constexpr std::string_view kPlaceholder = "Hello, world!";
+
+struct ArchiveRange {
+  uint64_t offset;
+  uint64_t length;
+  uint64_t dataOffset;
+};
+
+// Index key of a path stored in an archive: absolute, without empty, "."
+// or trailing segments, and with ".." resolved but never above the root, so
+// names written by other tools land inside the image. Empty for no name.
+std::string canonicalArchivePath(const char *name) {
+  std::string path;
+  if (name == nullptr) {
+    return path;
+  }
+  for (const char *segment = name; *segment != '\0';) {
+    const char *end = std::strchr(segment, '/');
+    size_t length = end == nullptr ? std::strlen(segment) : end - segment;
+    std::string_view part(segment, length);
+    if (part == "..") {
+      path.erase(std::min(path.size(), path.find_last_of('/')));
+    } else if (!part.empty() && part != ".") {
+      path += '/';
+      path += part;
+    }
+    segment += length + (end != nullptr);
+  }
+  return path.empty() ? "/" : path;
+}
+
+std::string storagePathOf(struct archive_entry *entry) {
+  return canonicalArchivePath(archive_entry_pathname(entry));
+}
+
+struct archive *openArchiveReader(const std::string &path) {
+  struct archive *reader = archive_read_new();
+  if (reader == nullptr) {
+    throw std::runtime_error("Failed to create archive reader");
+  }
+  if (archive_read_support_format_tar(reader) != ARCHIVE_OK) {
+    archive_read_free(reader);
+    throw std::runtime_error("Failed to set archive format for reading");
+  }
+  if (archive_read_open_filename(reader, path.c_str(), 10240) != ARCHIVE_OK) {
+    archive_read_free(reader);
+    throw std::runtime_error("Failed to open archive for reading");
+  }
+  return reader;
+}
+
+// Copies `length` bytes at `offset` of `source` to `outOffset` of
+// `destination`, in kernel space where the platform allows it.
+void copyRange(std::FILE *source, std::FILE *destination, uint64_t offset,
+               uint64_t length, uint64_t &outOffset) {
+  instrumentation::archiveBytesRead.fetch_add(length,
+                                              std::memory_order_relaxed);
+#ifdef __linux__
+  std::fflush(destination);
+  off_t in = offset, out = outOffset;
+  while (length > 0) {
+    ssize_t copied = copy_file_range(fileno(source), &in, fileno(destination),
+                                     &out, length, 0);
+    if (copied <= 0) {
+      break;
+    }
+    length -= copied;
+  }
+  offset = in;
+  outOffset = out;
+#endif
+  std::vector<char> buffer(std::min<uint64_t>(length, kCopyBufferSize));
+  while (length > 0) {
+    size_t chunk = std::min<uint64_t>(length, buffer.size());
+    if (std::fseek(source, offset, SEEK_SET) != 0 ||
+        std::fread(buffer.data(), 1, chunk, source) != chunk) {
+      throw std::runtime_error("Failed to read archive during compaction");
+    }
+    if (std::fseek(destination, outOffset, SEEK_SET) != 0 ||
+        std::fwrite(buffer.data(), 1, chunk, destination) != chunk) {
+      throw std::runtime_error("Failed to write compacted archive");
+    }
+    offset += chunk;
+    outOffset += chunk;
+    length -= chunk;
+  }
+}
+
+// Reads without moving a shared file position, so workers never contend on a
+// seek.
+size_t readAt(std::FILE *file, char *buffer, size_t length, uint64_t offset) {
+#ifdef _WIN32
+  if (_fseeki64(file, offset, SEEK_SET) != 0) {
+    return 0;
+  }
+  return std::fread(buffer, 1, length, file);
+#else
+  ssize_t read = pread(fileno(file), buffer, length, offset);
+  return read < 0 ? 0 : read;
+#endif
+}
+
+// Writes entries at the current position of `file`. The last block is left
+// unpadded so the archive stays densely packed.
+struct archive *openFileWriter(std::FILE *file, int bytesPerBlock) {
+  struct archive *writer = archive_write_new();
+  if (writer == nullptr ||
+      archive_write_set_format_pax_restricted(writer) != ARCHIVE_OK ||
+      archive_write_set_bytes_per_block(writer, bytesPerBlock) != ARCHIVE_OK ||
+      archive_write_set_bytes_in_last_block(writer, 1) != ARCHIVE_OK ||
+      archive_write_open_FILE(writer, file) != ARCHIVE_OK) {
+    archive_write_free(writer);
+    return nullptr;
+  }
+  return writer;
+}
+
+// Word-at-a-time multiplicative hash of a byte stream. Equal hashes are
+// always confirmed by comparing the bytes, so it only has to be fast and well
+// spread.
+class ContentHash {
+public:
+  void update(const char *data, size_t size) {
+    length += size;
+    while (size > 0 && pendingSize > 0) {
+      push(*data++);
+      --size;
+    }
+    for (; size >= sizeof(uint64_t); data += 8, size -= 8) {
+      uint64_t word;
+      std::memcpy(&word, data, sizeof(word));
+      mix(word);
+    }
+    while (size-- > 0) {
+      push(*data++);
+    }
+  }
+
+  uint64_t digest() const {
+    uint64_t hash = state ^ pending ^ (length * 0x9e3779b97f4a7c15ull);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 33);
+  }
+
+private:
+  uint64_t state = 0x243f6a8885a308d3ull;
+  uint64_t pending = 0;
+  size_t pendingSize = 0;
+  uint64_t length = 0;
+
+  void mix(uint64_t word) {
+    word *= 0x87c37b91114253d5ull;
+    word = (word << 31) | (word >> 33);
+    state ^= word * 0x4cf5ad432745937full;
+    state = ((state << 27) | (state >> 37)) * 5 + 0x52dce729;
+  }
+
+  void push(char byte) {
+    pending |= static_cast<uint64_t>(static_cast<unsigned char>(byte))
+               << (8 * pendingSize);
+    if (++pendingSize == sizeof(uint64_t)) {
+      mix(pending);
+      pending = 0;
+      pendingSize = 0;
+    }
+  }
+};
+
+// Reads `length` bytes of a payload starting `offset` bytes into it.
+using ContentReader =
+    std::function<bool(char *buffer, size_t length, uint64_t offset)>;
+
+ContentReader archiveContent(std::FILE *archive, uint64_t offset) {
+  return [archive, offset](char *buffer, size_t length, uint64_t at) {
+    return readAt(archive, buffer, length, offset + at) == length;
+  };
+}
+
+ContentReader hostContent(std::FILE *file) {
+  return [file](char *buffer, size_t length, uint64_t at) {
+    return std::fseek(file, at, SEEK_SET) == 0 &&
+           std::fread(buffer, 1, length, file) == length;
+  };
+}
+
+bool sameContent(const ContentReader &a, const ContentReader &b,
+                 uint64_t size) {
+  std::vector<char> left(std::min<uint64_t>(size, kCopyBufferSize));
+  std::vector<char> right(left.size());
+  for (uint64_t done = 0; done < size; done += left.size()) {
+    size_t chunk = std::min<uint64_t>(size - done, left.size());
+    if (!a(left.data(), chunk, done) || !b(right.data(), chunk, done) ||
+        std::memcmp(left.data(), right.data(), chunk) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void syncFile(std::FILE *file) {
+  std::fflush(file);
+#ifdef _WIN32
+  _commit(_fileno(file));
+#else
+  fsync(fileno(file));
+#endif
+}
+} // namespace
 
 VirtualFilesystem::VirtualFilesystem(const std::string &path)
-    : currentDirectory("/"), archivePath(path) {
+    : archivePath(path), currentDirectory("/"), dataEnd(0), staleEntries(0),
+      lastMutation(std::chrono::steady_clock::now()), idleCompactionDelay(0),
+      stopCompactor(false), compacting(false), contentIndexed(false) {
   fileStorage = std::make_unique<FileStorage>();
-  archive = archive_write_new();
-  if (archive == nullptr)
-    throw std::runtime_error("Failed to create archive");
 
   if (!archivePath.empty()) {
     loadArchive();
@@ -23,116 +256,654 @@ VirtualFilesystem::VirtualFilesystem(const std::string &path)
 }
 
 VirtualFilesystem::~VirtualFilesystem() {
-  if (archive != nullptr) {
-    archive_write_close(archive);
-    archive_write_free(archive);
+  watcher.reset();
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    stopCompactor = true;
+  }
+  compactorWake.notify_all();
+  if (compactor.joinable()) {
+    compactor.join();
+  }
+
+  try {
+    foldJournal();
+    journal.reset();
+    // Removals not compacted away yet are replayed on the next mount.
+    if (pendingRemovals.empty()) {
+      std::filesystem::remove(journalPath());
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to fold journal: " << e.what() << std::endl;
   }
 }
 
+std::string VirtualFilesystem::journalPath() const {
+  return archivePath + ".journal";
+}
+
 void VirtualFilesystem::createDefaultArchive() {
   if (std::filesystem::exists(archivePath)) {
     throw std::runtime_error("Archive already exists: " + archivePath);
   }
 
-  if (archive_write_set_format_pax_restricted(archive) != ARCHIVE_OK) {
-    archive_write_free(archive);
-    throw std::runtime_error("Failed to set archive format");
-  }
-  if (archive_write_open_filename(archive, archivePath.c_str()) != ARCHIVE_OK) {
-    throw std::runtime_error("Failed to open archive for writing");
-  }
+  // A journal without its archive is left over from a discarded image.
+  std::filesystem::remove(journalPath());
+  std::ofstream(archivePath, std::ios::binary);
+  journal = std::make_unique<Journal>(journalPath());
 
   addFileToArchiveAndStorage("/hello", std::strlen("Hello, world!"),
                              FileType::REG);
   addFileToArchiveAndStorage("/dir", 0, FileType::DIR);
   addFileToArchiveAndStorage("/dir/dir2", 0, FileType::DIR);
   addFileToArchiveAndStorage("/dir/file", 0, FileType::REG);
+  foldJournal();
 }
 
 void VirtualFilesystem::loadArchive() {
-  std::string tempPath = archivePath + ".temp";
-  struct archive *tempArchive = archive_write_new();
-  if (archive_write_set_format_pax_restricted(tempArchive) != ARCHIVE_OK) {
-    throw std::runtime_error("Failed to set format for temp archive");
+  uint64_t archiveSize = std::filesystem::file_size(archivePath);
+  struct archive *reader = openArchiveReader(archivePath);
+
+  // Only an offset table is built here; directories are materialized on
+  // first use. A damaged or truncated tail is ignored; the next fold
+  // overwrites it.
+  struct archive_entry *entry;
+  int status;
+  while ((status = archive_read_next_header(reader, &entry)) == ARCHIVE_OK ||
+         status == ARCHIVE_WARN) {
+    uint64_t offset = archive_filter_bytes(reader, 0);
+    la_int64_t size = archive_entry_size(entry);
+    int type = archive_entry_filetype(entry);
+    FileType fileType = (type == AE_IFDIR) ? FileType::DIR : FileType::REG;
+    std::string path = storagePathOf(entry);
+
+    status = archive_read_data_skip(reader);
+    if (status != ARCHIVE_OK || size < 0 ||
+        static_cast<uint64_t>(archive_filter_bytes(reader, 0)) > archiveSize) {
+      break;
+    }
+    dataEnd = archive_filter_bytes(reader, 0);
+    // The root always exists; an entry for it carries nothing.
+    if (path == "/") {
+      continue;
+    }
+    if (const char *target = archive_entry_hardlink(entry)) {
+      fileStorage->addLazyLink(path, canonicalArchivePath(target), offset);
+    } else {
+      fileStorage->addLazy(path, size, fileType, offset);
+    }
   }
-  if (archive_write_open_filename(tempArchive, tempPath.c_str()) !=
-      ARCHIVE_OK) {
-    archive_write_free(tempArchive);
-    throw std::runtime_error("Failed to open temp archive for writing");
+  if (status != ARCHIVE_EOF) {
+    const char *error = archive_error_string(reader);
+    std::cerr << "Ignoring damaged archive data after offset " << dataEnd
+              << ": " << (error != nullptr ? error : "unknown error")
+              << std::endl;
   }
+  instrumentation::archiveBytesRead.fetch_add(archive_filter_bytes(reader, -1),
+                                              std::memory_order_relaxed);
+  archive_read_free(reader);
 
-  struct archive *archiveReader = archive_read_new();
-  if (archiveReader == nullptr) {
-    archive_write_free(tempArchive);
-    throw std::runtime_error("Failed to create archive reader");
+  // Later entries for the same path supersede earlier ones, as with tar -x.
+  staleEntries += fileStorage->sealLazy();
+
+  pendingRecords = Journal::replay(journalPath());
+  for (const JournalRecord &record : pendingRecords) {
+    applyRecord(record);
   }
-  if (archive_read_support_format_tar(archiveReader) != ARCHIVE_OK) {
-    archive_write_free(tempArchive);
-    archive_read_free(archiveReader);
-    throw std::runtime_error("Failed to set archive format for reading");
+  journal = std::make_unique<Journal>(journalPath());
+  foldJournal();
+}
+
+size_t VirtualFilesystem::refresh() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  return mergeTail();
+}
+
+size_t VirtualFilesystem::mergeTail() {
+  // Compaction carries the tail over; the new archive is merged after.
+  if (compacting) {
+    return 0;
   }
-  if (archive_read_open_filename(archiveReader, archivePath.c_str(), 10240) !=
-      ARCHIVE_OK) {
-    archive_write_free(tempArchive);
-    archive_read_free(archiveReader);
+  // Our own appends end in a trailer right after dataEnd; anything longer
+  // may hold entries written by another program over that trailer.
+  std::error_code error;
+  uint64_t archiveSize = std::filesystem::file_size(archivePath, error);
+  if (error || archiveSize <= dataEnd + kTarTrailerSize) {
+    return 0;
+  }
+  std::FILE *file = std::fopen(archivePath.c_str(), "rb");
+  if (file == nullptr) {
+    return 0;
+  }
+  struct archive *reader = archive_read_new();
+  if (reader == nullptr || std::fseek(file, dataEnd, SEEK_SET) != 0 ||
+      archive_read_support_format_tar(reader) != ARCHIVE_OK ||
+      archive_read_open_FILE(reader, file) != ARCHIVE_OK) {
+    archive_read_free(reader);
+    std::fclose(file);
     throw std::runtime_error("Failed to open archive for reading");
   }
 
+  // Offsets are relative to where the reader started.
+  uint64_t tailStart = dataEnd;
+  size_t merged = 0;
   struct archive_entry *entry;
-  while (archive_read_next_header(archiveReader, &entry) == ARCHIVE_OK) {
-    const char *path = archive_entry_pathname(entry);
-    size_t size = archive_entry_size(entry);
-    int type = archive_entry_filetype(entry);
-    FileType fileType = (type == AE_IFDIR) ? FileType::DIR : FileType::REG;
+  int status;
+  while ((status = archive_read_next_header(reader, &entry)) == ARCHIVE_OK ||
+         status == ARCHIVE_WARN) {
+    uint64_t offset = tailStart + archive_filter_bytes(reader, 0);
+    la_int64_t size = archive_entry_size(entry);
+    FileType fileType =
+        archive_entry_filetype(entry) == AE_IFDIR ? FileType::DIR
+                                                  : FileType::REG;
+    std::string path = storagePathOf(entry);
+    const char *target = archive_entry_hardlink(entry);
+    std::string linkTarget = canonicalArchivePath(target);
+
+    status = archive_read_data_skip(reader);
+    uint64_t entryEnd = tailStart + archive_filter_bytes(reader, 0);
+    if (status != ARCHIVE_OK || size < 0 || entryEnd > archiveSize) {
+      break;
+    }
+    dataEnd = entryEnd;
+    if (path == "/") {
+      continue;
+    }
+    if (target != nullptr) {
+      // Links resolve against what was indexed before them.
+      size = 0;
+      if (fileStorage->exists(linkTarget)) {
+        const Metadata &source = fileStorage->getMetadata(linkTarget);
+        size = source.size;
+        fileType = source.fileType;
+        offset = source.offset;
+      }
+    }
+
+    // As at mount, the later entry supersedes; a directory already present
+    // keeps its children.
+    if (fileStorage->exists(path)) {
+      ++staleEntries;
+      if (fileType == FileType::DIR &&
+          fileStorage->getMetadata(path).fileType == FileType::DIR) {
+        continue;
+      }
+      fileStorage->remove(path);
+    }
+    fileStorage->add(path, size, fileType, offset);
+    pendingRemovals.erase(path);
+    ++merged;
+  }
+  instrumentation::archiveBytesRead.fetch_add(archive_filter_bytes(reader, -1),
+                                              std::memory_order_relaxed);
+  archive_read_free(reader);
+  std::fclose(file);
+
+  // Blocks cached past the old end held its trailer.
+  blockCache.invalidateFrom(tailStart);
+  return merged;
+}
 
-    addFileToStorage(path, size, fileType);
+void VirtualFilesystem::watchArchive(
+    std::function<void(size_t merged)> onChange) {
+  // The watcher calls refresh(), which takes the lock, so it is stopped
+  // without holding it.
+  watcher.reset();
+  if (!onChange) {
+    return;
+  }
+  watcher = std::make_unique<FileWatcher>(
+      archivePath, [this, onChange = std::move(onChange)]() {
+        try {
+          if (size_t merged = refresh()) {
+            onChange(merged);
+          }
+        } catch (const std::exception &e) {
+          std::cerr << "Failed to refresh archive: " << e.what() << std::endl;
+        }
+      });
+}
 
-    archive_write_header(tempArchive, entry);
-    if (fileType == FileType::REG && size > 0) {
-      std::vector<char> buffer(size);
-      archive_read_data(archiveReader, buffer.data(), size);
-      archive_write_data(tempArchive, buffer.data(), size);
+void VirtualFilesystem::applyRecord(const JournalRecord &record) {
+  switch (record.op) {
+  case JournalOp::ADD:
+  case JournalOp::COPY:
+    if (fileStorage->exists(record.path)) {
+      fileStorage->remove(record.path);
     }
+    fileStorage->add(record.path, record.size, record.fileType,
+                     record.op == JournalOp::COPY &&
+                             fileStorage->exists(record.source)
+                         ? fileStorage->getMetadata(record.source).offset
+                         : 0);
+    break;
+  case JournalOp::REMOVE:
+    if (fileStorage->exists(record.path)) {
+      fileStorage->remove(record.path);
+    }
+    ++staleEntries;
+    break;
   }
+}
 
-  archive_read_free(archiveReader);
-  archive_write_close(tempArchive);
-  archive_write_free(tempArchive);
+uint64_t VirtualFilesystem::logRecord(JournalRecord record) {
+  uint64_t sequence = journal->append(record);
+  pendingRecords.push_back(std::move(record));
+  lastMutation = std::chrono::steady_clock::now();
+  if (pendingRecords.size() >= kMaxPendingRecords) {
+    foldJournal();
+  }
+  return sequence;
+}
 
-  if (archive_write_set_format_pax_restricted(archive) != ARCHIVE_OK) {
-    throw std::runtime_error("Failed to set archive format");
+bool VirtualFilesystem::commitRecords(uint64_t sequence) {
+  // A failed write leaves the records pending: they still reach the archive
+  // with the next fold, only surviving a crash before then is not assured.
+  try {
+    journal->commit(sequence);
+  } catch (const std::exception &e) {
+    std::cerr << "Error writing journal: " << e.what() << std::endl;
+    return false;
   }
-  if (archive_write_open_filename(archive, archivePath.c_str()) != ARCHIVE_OK) {
-    throw std::runtime_error("Failed to open archive for writing");
+  return true;
+}
+
+struct archive *VirtualFilesystem::openAppendWriter(std::FILE *&file,
+                                                    int bytesPerBlock) {
+  file = std::fopen(archivePath.c_str(), "r+b");
+  if (file == nullptr) {
+    throw std::runtime_error("Failed to open archive for appending");
+  }
+  if (std::fseek(file, dataEnd, SEEK_SET) != 0) {
+    std::fclose(file);
+    throw std::runtime_error("Failed to seek in archive: " + archivePath);
   }
 
-  struct archive *tempReader = archive_read_new();
-  if (archive_read_support_format_tar(tempReader) != ARCHIVE_OK) {
-    archive_read_free(tempReader);
-    throw std::runtime_error("Failed to set format for temp reading");
+  // New entries overwrite the end-of-archive marker.
+  blockCache.invalidateFrom(dataEnd);
+  struct archive *writer = openFileWriter(file, bytesPerBlock);
+  if (writer == nullptr) {
+    std::fclose(file);
+    throw std::runtime_error("Failed to open archive for appending");
   }
-  if (archive_read_open_filename(tempReader, tempPath.c_str(), 10240) !=
-      ARCHIVE_OK) {
-    archive_read_free(tempReader);
-    throw std::runtime_error("Failed to open temp archive for reading");
+  return writer;
+}
+
+void VirtualFilesystem::closeAppendWriter(struct archive *writer,
+                                          std::FILE *file) {
+  bool closed = archive_write_close(writer) == ARCHIVE_OK;
+  archive_write_free(writer);
+  if (!closed) {
+    std::fclose(file);
+    throw std::runtime_error("Failed to finish writing archive: " +
+                             archivePath);
   }
 
-  while (archive_read_next_header(tempReader, &entry) == ARCHIVE_OK) {
-    archive_write_header(archive, entry);
-    size_t size = archive_entry_size(entry);
-    if (archive_entry_filetype(entry) == AE_IFREG && size > 0) {
-      std::vector<char> buffer(size);
-      archive_read_data(tempReader, buffer.data(), size);
-      archive_write_data(archive, buffer.data(), size);
+  uint64_t archiveEnd = std::ftell(file);
+  syncFile(file);
+  std::fclose(file);
+  if (std::filesystem::file_size(archivePath) > archiveEnd) {
+    std::filesystem::resize_file(archivePath, archiveEnd);
+  }
+  dataEnd = archiveEnd - kTarTrailerSize;
+}
+
+void VirtualFilesystem::foldJournal() {
+  // A running compaction folds what piled up once it is done.
+  if (pendingRecords.empty() || compacting) {
+    return;
+  }
+
+  // Entries appended by others are indexed first so the fold does not
+  // overwrite them; replaying the batch keeps its changes on top.
+  if (mergeTail() > 0) {
+    for (const JournalRecord &record : pendingRecords) {
+      applyRecord(record);
     }
   }
 
-  archive_read_free(tempReader);
-  std::filesystem::remove(tempPath);
+  // A removed entry only leaves the archive through compaction, so its
+  // record is kept in the journal until then, unless the path is written
+  // again, which supersedes the old entry on the next mount anyway.
+  bool hasWrites = false;
+  for (const JournalRecord &record : pendingRecords) {
+    if (record.op == JournalOp::REMOVE) {
+      pendingRemovals[record.path] = record;
+    } else {
+      pendingRemovals.erase(record.path);
+      hasWrites = true;
+    }
+  }
+  if (hasWrites) {
+    appendRecords();
+  }
+  pendingRecords.clear();
+  resetJournal();
 }
 
-void VirtualFilesystem::addFileToArchive(const std::string &path, size_t size,
-                                         FileType fileType) {
+void VirtualFilesystem::appendRecords() {
+  std::FILE *file;
+  uint64_t appendStart = dataEnd;
+  struct archive *writer = openAppendWriter(file);
+  std::FILE *archive = std::fopen(archivePath.c_str(), "rb");
+  try {
+    if (archive == nullptr) {
+      throw std::runtime_error("Failed to open archive for reading");
+    }
+    // Offsets are recorded as entries are written so that copies later in
+    // the batch see where their source went.
+    for (const JournalRecord &record : pendingRecords) {
+      uint64_t offset;
+      if (record.op == JournalOp::REMOVE) {
+        continue;
+      } else if (record.op == JournalOp::COPY &&
+                 record.fileType == FileType::REG) {
+        offset = foldCopy(writer, archive, appendStart, record);
+      } else {
+        offset = appendStart + addFileToArchive(writer, record.path,
+                                                record.size, record.fileType);
+      }
+      if (fileStorage->exists(record.path)) {
+        fileStorage->setOffset(record.path, offset);
+      }
+    }
+  } catch (...) {
+    archive_write_free(writer);
+    std::fclose(file);
+    if (archive != nullptr) {
+      std::fclose(archive);
+    }
+    throw;
+  }
+  std::fclose(archive);
+  closeAppendWriter(writer, file);
+}
+
+void VirtualFilesystem::resetJournal() {
+  std::vector<JournalRecord> keep;
+  keep.reserve(pendingRemovals.size() + pendingRecords.size());
+  for (const auto &removal : pendingRemovals) {
+    keep.push_back(removal.second);
+  }
+  keep.insert(keep.end(), pendingRecords.begin(), pendingRecords.end());
+  journal->reset(keep);
+}
+
+uint64_t VirtualFilesystem::foldCopy(struct archive *writer,
+                                     std::FILE *archive, uint64_t appendStart,
+                                     const JournalRecord &record) {
+  // A copy shares its source's payload: it becomes a hard link while the
+  // source still holds it, and takes its own copy of the bytes otherwise.
+  uint64_t payload = fileStorage->exists(record.path)
+                         ? fileStorage->getMetadata(record.path).offset
+                         : 0;
+  if (fileStorage->exists(record.source)) {
+    const Metadata &source = fileStorage->getMetadata(record.source);
+    if (source.fileType == FileType::REG &&
+        (payload == 0 || source.offset == payload)) {
+      addLinkToArchive(writer, record.path, record.source);
+      return source.offset;
+    }
+  }
+  if (payload != 0 && payload < appendStart) {
+    return appendStart + addFileToArchive(writer, record.path, record.size,
+                                          FileType::REG, archive, payload);
+  }
+  return appendStart + addFileToArchive(writer, record.path, record.size,
+                                        FileType::REG);
+}
+
+uint64_t VirtualFilesystem::compact() {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  compactionDone.wait(lock, [this] { return !compacting; });
+  foldJournal();
+  return compactArchive(lock);
+}
+
+uint64_t VirtualFilesystem::compactArchive(
+    std::unique_lock<std::recursive_mutex> &lock) {
+  compactionDone.wait(lock, [this] { return !compacting; });
+  mergeTail();
+  // Keep the last copy of every path that is still in the index.
+  std::unordered_map<std::string, ArchiveRange> liveEntries;
+  std::unordered_map<std::string, std::string> liveLinks;
+  uint64_t scannedEnd = 0;
+
+  struct archive *reader = openArchiveReader(archivePath);
+  struct archive_entry *entry;
+  int status;
+  while ((status = archive_read_next_header(reader, &entry)) == ARCHIVE_OK ||
+         status == ARCHIVE_WARN) {
+    uint64_t offset = archive_read_header_position(reader);
+    uint64_t dataOffset = archive_filter_bytes(reader, 0);
+    std::string path = storagePathOf(entry);
+    const char *target = archive_entry_hardlink(entry);
+    std::string linkTarget = canonicalArchivePath(target);
+    if (archive_read_data_skip(reader) != ARCHIVE_OK) {
+      break;
+    }
+    scannedEnd = archive_filter_bytes(reader, 0);
+
+    if (fileStorage->exists(path)) {
+      liveEntries[path] = {offset, scannedEnd - offset, dataOffset};
+      if (target != nullptr) {
+        liveLinks[path] = linkTarget;
+      } else {
+        liveLinks.erase(path);
+      }
+    }
+  }
+  instrumentation::archiveBytesRead.fetch_add(archive_filter_bytes(reader, -1),
+                                              std::memory_order_relaxed);
+  archive_read_free(reader);
+
+  std::vector<std::pair<ArchiveRange, const std::string *>> liveRanges;
+  liveRanges.reserve(liveEntries.size());
+  for (const auto &[path, range] : liveEntries) {
+    liveRanges.emplace_back(range, &path);
+  }
+  std::sort(liveRanges.begin(), liveRanges.end(),
+            [](const auto &a, const auto &b) {
+              return a.first.offset < b.first.offset;
+            });
+
+  // Entries keep their order, so each payload moves down by the bytes
+  // dropped in front of it. A hard link is kept only while its target is
+  // kept ahead of it and still holds the same payload; the others are
+  // rewritten after the kept entries.
+  std::vector<ArchiveRange> keptRanges;
+  std::vector<Metadata> relinked;
+  std::unordered_set<std::string_view> relinkedPaths;
+  std::unordered_map<uint64_t, uint64_t> movedPayloads;
+  std::unordered_map<uint64_t, std::string> payloadHolders;
+  uint64_t packedEnd = 0;
+  for (const auto &[range, path] : liveRanges) {
+    const Metadata &metadata = fileStorage->getMetadata(*path);
+    auto link = liveLinks.find(*path);
+    if (link != liveLinks.end()) {
+      auto target = liveEntries.find(link->second);
+      if (target == liveEntries.end() || target->second.offset > range.offset ||
+          relinkedPaths.count(link->second) != 0 ||
+          fileStorage->getMetadata(link->second).offset != metadata.offset) {
+        relinked.push_back(metadata);
+        relinkedPaths.insert(*path);
+        continue;
+      }
+    } else {
+      movedPayloads[range.dataOffset] =
+          packedEnd + range.dataOffset - range.offset;
+    }
+    payloadHolders.emplace(metadata.offset, *path);
+    keptRanges.push_back(range);
+    packedEnd += range.length;
+  }
+
+  // The copy runs without the lock. Meanwhile mutations only reach the
+  // journal: folds and merges wait, so nothing but other programs extends
+  // the old archive, and offsets in the index keep pointing into it.
+  uint64_t oldEnd = dataEnd;
+  size_t oldStaleEntries = staleEntries;
+  compacting = true;
+  lock.unlock();
+
+  std::string compactPath = archivePath + ".compact";
+  uint64_t newEnd = 0;
+  std::FILE *source = std::fopen(archivePath.c_str(), "rb");
+  std::FILE *destination = std::fopen(compactPath.c_str(), "wb");
+  struct archive *writer = nullptr;
+  uint64_t oldSize = 0;
+  try {
+    if (source == nullptr || destination == nullptr) {
+      throw std::runtime_error("Failed to open files for compaction");
+    }
+    size_t i = 0;
+    while (i < keptRanges.size()) {
+      ArchiveRange run = keptRanges[i++];
+      while (i < keptRanges.size() &&
+             keptRanges[i].offset == run.offset + run.length) {
+        run.length += keptRanges[i++].length;
+      }
+      copyRange(source, destination, run.offset, run.length, newEnd);
+    }
+
+    if (std::fseek(destination, newEnd, SEEK_SET) != 0) {
+      throw std::runtime_error("Failed to write compacted archive");
+    }
+    if (!relinked.empty()) {
+      // The first path of a payload that lost its holder takes the bytes;
+      // any further ones link to it.
+      writer = openFileWriter(destination, 10240);
+      if (writer == nullptr) {
+        throw std::runtime_error("Failed to write compacted archive");
+      }
+      for (const Metadata &metadata : relinked) {
+        auto holder = payloadHolders.find(metadata.offset);
+        if (holder != payloadHolders.end()) {
+          addLinkToArchive(writer, metadata.path, holder->second);
+        } else {
+          movedPayloads[metadata.offset] =
+              newEnd + addFileToArchive(writer, metadata.path, metadata.size,
+                                        FileType::REG, source,
+                                        metadata.offset);
+          payloadHolders.emplace(metadata.offset, metadata.path);
+        }
+      }
+      if (archive_write_close(writer) != ARCHIVE_OK) {
+        throw std::runtime_error("Failed to write compacted archive");
+      }
+      archive_write_free(writer);
+      writer = nullptr;
+      newEnd = std::ftell(destination) - kTarTrailerSize;
+    }
+
+    // Entries another program appended in the meantime move over as they
+    // are, trailer included, for the next merge to index.
+    lock.lock();
+    oldSize = std::filesystem::file_size(archivePath);
+    uint64_t tailEnd = oldSize > oldEnd + kTarTrailerSize
+                           ? oldSize
+                           : oldEnd + kTarTrailerSize;
+    uint64_t copiedEnd = newEnd;
+    copyRange(source, destination, oldEnd, tailEnd - oldEnd, copiedEnd);
+    syncFile(destination);
+    std::fclose(source);
+    std::fclose(destination);
+    std::filesystem::rename(compactPath, archivePath);
+    blockCache.clear();
+  } catch (...) {
+    if (!lock.owns_lock()) {
+      lock.lock();
+    }
+    if (writer != nullptr) {
+      archive_write_free(writer);
+    }
+    if (source != nullptr) {
+      std::fclose(source);
+    }
+    if (destination != nullptr) {
+      std::fclose(destination);
+    }
+    std::filesystem::remove(compactPath);
+    compacting = false;
+    compactionDone.notify_all();
+    throw;
+  }
+
+  // Records journaled during the copy may hold offsets of payloads that
+  // moved as well.
+  auto relocate = [&](const std::string &path) {
+    if (!fileStorage->exists(path)) {
+      return;
+    }
+    auto moved = movedPayloads.find(fileStorage->getMetadata(path).offset);
+    if (moved != movedPayloads.end()) {
+      fileStorage->setOffset(path, moved->second);
+    }
+  };
+  for (const auto &liveEntry : liveEntries) {
+    relocate(liveEntry.first);
+  }
+  for (const JournalRecord &record : pendingRecords) {
+    relocate(record.path);
+  }
+  dataEnd = newEnd;
+  staleEntries -= std::min(staleEntries, oldStaleEntries);
+  pendingRemovals.clear();
+  compacting = false;
+  compactionDone.notify_all();
+  resetJournal();
+  foldJournal();
+
+  uint64_t newSize = newEnd + kTarTrailerSize;
+  return oldSize > newSize ? oldSize - newSize : 0;
+}
+
+void VirtualFilesystem::setIdleCompactionDelay(
+    std::chrono::milliseconds delay) {
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    idleCompactionDelay = delay;
+    if (delay.count() > 0 && !compactor.joinable()) {
+      compactor = std::thread(&VirtualFilesystem::runIdleCompactor, this);
+    }
+  }
+  compactorWake.notify_all();
+}
+
+void VirtualFilesystem::runIdleCompactor() {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  while (!stopCompactor) {
+    if (idleCompactionDelay.count() == 0) {
+      compactorWake.wait(lock);
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto idleSince = lastMutation + idleCompactionDelay;
+    bool hasWork = staleEntries > 0 || !pendingRecords.empty();
+    if (hasWork && now >= idleSince) {
+      try {
+        foldJournal();
+        if (staleEntries > 0) {
+          compactArchive(lock);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Idle compaction failed: " << e.what() << std::endl;
+        lastMutation = now;
+      }
+      continue;
+    }
+
+    compactorWake.wait_until(lock, std::max(idleSince,
+                                            now + idleCompactionDelay));
+  }
+}
+
+uint64_t VirtualFilesystem::addFileToArchive(struct archive *writer,
+                                             const std::string &path,
+                                             size_t size, FileType fileType,
+                                             std::FILE *content,
+                                             uint64_t contentOffset) {
   struct archive_entry *entry = archive_entry_new();
   if (entry == nullptr) {
     throw std::runtime_error("Failed to create archive entry");
@@ -145,25 +916,64 @@ void VirtualFilesystem::addFileToArchive(const std::string &path, size_t size,
   archive_entry_set_filetype(entry, archiveType);
   archive_entry_set_perm(entry, 0755);
 
-  if (archive_write_header(archive, entry) != ARCHIVE_OK) {
+  if (archive_write_header(writer, entry) != ARCHIVE_OK) {
     archive_entry_free(entry);
     throw std::runtime_error("Failed to write header for " + path);
   }
+  uint64_t dataOffset = archive_filter_bytes(writer, 0);
 
-  if (fileType == FileType::REG && size > 0) {
-    const char *content = "Hello, world!";
-    if (archive_write_data(archive, content, std::strlen(content)) !=
-        std::strlen(content)) {
+  if (fileType == FileType::REG && size > 0 && content != nullptr) {
+    std::vector<char> buffer(std::min<uint64_t>(size, kCopyBufferSize));
+    for (uint64_t done = 0; done < size; done += buffer.size()) {
+      size_t chunk = std::min<uint64_t>(size - done, buffer.size());
+      if (readAt(content, buffer.data(), chunk, contentOffset + done) !=
+              chunk ||
+          archive_write_data(writer, buffer.data(), chunk) !=
+              static_cast<la_ssize_t>(chunk)) {
+        archive_entry_free(entry);
+        throw std::runtime_error("Failed to write data to " + path);
+      }
+    }
+    instrumentation::archiveBytesRead.fetch_add(size,
+                                                std::memory_order_relaxed);
+  } else if (fileType == FileType::REG && size > 0) {
+    size_t length = std::min(size, kPlaceholder.size());
+    if (archive_write_data(writer, kPlaceholder.data(), length) !=
+        static_cast<la_ssize_t>(length)) {
       archive_entry_free(entry);
       throw std::runtime_error("Failed to write data to " + path);
     }
   }
 
   archive_entry_free(entry);
+  return dataOffset;
+}
+
+void VirtualFilesystem::addLinkToArchive(struct archive *writer,
+                                         const std::string &path,
+                                         const std::string &target) {
+  struct archive_entry *entry = archive_entry_new();
+  if (entry == nullptr) {
+    throw std::runtime_error("Failed to create archive entry");
+  }
+
+  archive_entry_set_pathname(entry, path.c_str());
+  archive_entry_set_hardlink(entry, target.c_str());
+  archive_entry_set_size(entry, 0);
+  archive_entry_set_filetype(entry, AE_IFREG);
+  archive_entry_set_perm(entry, 0755);
+
+  if (archive_write_header(writer, entry) != ARCHIVE_OK) {
+    archive_entry_free(entry);
+    throw std::runtime_error("Failed to write header for " + path);
+  }
+  archive_entry_free(entry);
 }
 
 bool VirtualFilesystem::addFileToStorage(const std::string &path, size_t size,
                                          FileType fileType) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  lastMutation = std::chrono::steady_clock::now();
   if (fileStorage->exists(path)) {
     std::cerr << "File or directory already exists: " << path << std::endl;
     return false;
@@ -176,26 +986,571 @@ bool VirtualFilesystem::addFileToStorage(const std::string &path, size_t size,
 bool VirtualFilesystem::addFileToArchiveAndStorage(const std::string &path,
                                                    size_t size,
                                                    FileType fileType) {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
   if (!addFileToStorage(path, size, fileType)) {
     return false;
   }
 
+  uint64_t sequence;
   try {
-    addFileToArchive(path, size, fileType);
+    sequence = logRecord({JournalOp::ADD, fileType, size, path, ""});
   } catch (const std::exception &e) {
     std::cerr << "Error adding file to archive: " << e.what() << std::endl;
     return false;
   }
+  // Committed without the lock so concurrent mutations share the fsync.
+  lock.unlock();
+  return commitRecords(sequence);
+}
 
-  return true;
+bool VirtualFilesystem::copyInArchiveAndStorage(const std::string &source,
+                                                const std::string &destination) {
+  return copyInArchiveAndStorage({{source, destination}}) == 1;
+}
+
+size_t VirtualFilesystem::copyInArchiveAndStorage(
+    const std::vector<std::pair<std::string, std::string>> &copies) {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  size_t copied = 0;
+  uint64_t sequence = 0;
+  try {
+    for (const auto &[source, destination] : copies) {
+      if (!fileStorage->exists(source)) {
+        break;
+      }
+      const Metadata metadata = fileStorage->getMetadata(source);
+      if (!addFileToStorage(destination, metadata.size, metadata.fileType)) {
+        break;
+      }
+      // The copy shares the source's payload until the journal is folded.
+      fileStorage->setOffset(destination, metadata.offset);
+      sequence = logRecord({JournalOp::COPY, metadata.fileType, metadata.size,
+                            destination, source});
+      ++copied;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Error copying file in archive: " << e.what() << std::endl;
+    return 0;
+  }
+  lock.unlock();
+  return sequence == 0 || commitRecords(sequence) ? copied : 0;
+}
+
+bool VirtualFilesystem::removeFromArchiveAndStorage(const std::string &path) {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  if (path == "/" || !fileStorage->exists(path)) {
+    return false;
+  }
+  const Metadata metadata = fileStorage->getMetadata(path);
+  fileStorage->remove(path);
+  ++staleEntries;
+
+  uint64_t sequence;
+  try {
+    sequence = logRecord({JournalOp::REMOVE, metadata.fileType, 0, path, ""});
+  } catch (const std::exception &e) {
+    std::cerr << "Error removing file from archive: " << e.what() << std::endl;
+    return false;
+  }
+  lock.unlock();
+  return commitRecords(sequence);
+}
+
+ImportSummary VirtualFilesystem::importDirectory(
+    const std::string &hostDirectory, const std::string &directory,
+    unsigned threads) {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  compactionDone.wait(lock, [this] { return !compacting; });
+  bool isDirectory = false;
+  std::string root = normalizePath(directory, isDirectory);
+  if (!isDirectory) {
+    throw std::runtime_error("Not a directory: " + directory);
+  }
+  if (!std::filesystem::is_directory(hostDirectory)) {
+    throw std::runtime_error("Not a host directory: " + hostDirectory);
+  }
+  foldJournal();
+  mergeTail();
+
+  // The walk relies on the file type reported by readdir; stat and read
+  // happen on the workers.
+  struct HostFile {
+    std::filesystem::path hostPath;
+    std::string path;
+  };
+  ImportSummary summary;
+  std::vector<Metadata> imported;
+  std::vector<HostFile> hostFiles;
+  std::string hostRoot =
+      std::filesystem::path(hostDirectory).lexically_normal().generic_string();
+  if (hostRoot.size() > 1 && hostRoot.back() == '/') {
+    hostRoot.pop_back();
+  }
+
+  auto options = std::filesystem::directory_options::skip_permission_denied;
+  for (auto it = std::filesystem::recursive_directory_iterator(hostRoot,
+                                                                options);
+       it != std::filesystem::recursive_directory_iterator(); ++it) {
+    std::string relative = it->path().generic_string().substr(hostRoot.size());
+    std::string path = (root == "/" ? "" : root) + relative;
+    if (it->is_symlink()) {
+      ++summary.skipped;
+    } else if (it->is_directory()) {
+      if (!fileStorage->exists(path)) {
+        imported.emplace_back(path, 0, FileType::DIR);
+      } else if (fileStorage->getMetadata(path).fileType != FileType::DIR) {
+        it.disable_recursion_pending();
+        ++summary.skipped;
+      }
+    } else if (it->is_regular_file() && !fileStorage->exists(path)) {
+      hostFiles.push_back({it->path(), path});
+    } else {
+      ++summary.skipped;
+    }
+  }
+
+  struct ReadResult {
+    size_t index;
+    uint64_t size;
+    std::filesystem::perms perms;
+    std::vector<char> data;
+    uint64_t hash;
+    bool streamed;
+    bool ok;
+  };
+  std::mutex queueMutex;
+  std::condition_variable ready, space;
+  std::deque<ReadResult> queue;
+  uint64_t queuedBytes = 0;
+  std::atomic<size_t> nextFile{0};
+  std::atomic<bool> aborted{false};
+
+  auto readFiles = [&]() {
+    size_t index;
+    while (!aborted && (index = nextFile++) < hostFiles.size()) {
+      ReadResult result{index, 0, std::filesystem::perms::none, {}, 0, false,
+                        false};
+      std::error_code error;
+      auto status = std::filesystem::status(hostFiles[index].hostPath, error);
+      result.size = std::filesystem::file_size(hostFiles[index].hostPath, error);
+      if (!error) {
+        result.perms = status.permissions();
+        result.streamed = result.size > kMaxBufferedFileSize;
+        std::FILE *file =
+            std::fopen(hostFiles[index].hostPath.string().c_str(), "rb");
+        result.ok = file != nullptr;
+        // Large files are hashed here and read again by the writer.
+        ContentHash hash;
+        if (result.ok && result.streamed) {
+          std::vector<char> buffer(kCopyBufferSize);
+          size_t read;
+          while ((read = std::fread(buffer.data(), 1, buffer.size(), file)) >
+                 0) {
+            hash.update(buffer.data(), read);
+          }
+        } else if (result.ok && result.size > 0) {
+          result.data.resize(result.size);
+          result.ok = std::fread(result.data.data(), 1, result.size, file) ==
+                      result.size;
+          hash.update(result.data.data(), result.data.size());
+        }
+        result.hash = hash.digest();
+        if (file != nullptr) {
+          std::fclose(file);
+        }
+      }
+
+      std::unique_lock<std::mutex> queueLock(queueMutex);
+      space.wait(queueLock, [&] {
+        return aborted || queuedBytes == 0 ||
+               queuedBytes + result.data.size() <= kImportQueueBytes;
+      });
+      queuedBytes += result.data.size();
+      queue.push_back(std::move(result));
+      ready.notify_one();
+    }
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> readers;
+  for (unsigned i = 0; i < threads && i < hostFiles.size(); ++i) {
+    readers.emplace_back(readFiles);
+  }
+  auto stopReaders = [&]() {
+    aborted = true;
+    space.notify_all();
+    for (std::thread &reader : readers) {
+      if (reader.joinable()) {
+        reader.join();
+      }
+    }
+  };
+
+  // Files whose content is already in the image, or earlier in this import,
+  // are stored as hard links. Earlier files of this import are still in the
+  // writer's buffer, so those are compared against the host copy.
+  std::unordered_multimap<uint64_t, std::pair<size_t, size_t>>
+      importedContent;
+  auto findDuplicate = [&](const ReadResult &result,
+                           const ContentReader &content,
+                           std::FILE *archive) -> const Metadata * {
+    hashPayloads(result.size, archive);
+    auto [first, last] = contentIndex.equal_range(result.hash);
+    for (auto it = first; it != last; ++it) {
+      if (!fileStorage->exists(it->second)) {
+        continue;
+      }
+      const Metadata &candidate = fileStorage->getMetadata(it->second);
+      if (candidate.fileType == FileType::REG &&
+          candidate.size == result.size && candidate.offset != 0 &&
+          sameContent(archiveContent(archive, candidate.offset), content,
+                      result.size)) {
+        return &candidate;
+      }
+    }
+    auto [batchFirst, batchLast] = importedContent.equal_range(result.hash);
+    for (auto it = batchFirst; it != batchLast; ++it) {
+      const auto [importedIndex, hostIndex] = it->second;
+      const Metadata &candidate = imported[importedIndex];
+      std::FILE *host =
+          std::fopen(hostFiles[hostIndex].hostPath.string().c_str(), "rb");
+      bool same = host != nullptr && candidate.size == result.size &&
+                  sameContent(hostContent(host), content, result.size);
+      if (host != nullptr) {
+        std::fclose(host);
+      }
+      if (same) {
+        return &candidate;
+      }
+    }
+    return nullptr;
+  };
+
+  indexContent();
+  std::FILE *archive = std::fopen(archivePath.c_str(), "rb");
+  std::FILE *file = nullptr;
+  struct archive *writer = nullptr;
+  struct archive_entry *entry = archive_entry_new();
+  try {
+    if (archive == nullptr) {
+      throw std::runtime_error("Failed to open archive for reading");
+    }
+    writer = openAppendWriter(file, kImportBlockSize);
+    for (Metadata &metadata : imported) {
+      metadata.offset =
+          dataEnd + addFileToArchive(writer, metadata.path, 0, FileType::DIR);
+    }
+    summary.directories = imported.size();
+
+    std::vector<char> buffer;
+    for (size_t done = 0; done < hostFiles.size(); ++done) {
+      std::unique_lock<std::mutex> queueLock(queueMutex);
+      ready.wait(queueLock, [&] { return !queue.empty(); });
+      ReadResult result = std::move(queue.front());
+      queue.pop_front();
+      queuedBytes -= result.data.size();
+      queueLock.unlock();
+      space.notify_all();
+
+      const HostFile &hostFile = hostFiles[result.index];
+      std::FILE *input = nullptr;
+      if (result.ok && result.streamed) {
+        input = std::fopen(hostFile.hostPath.string().c_str(), "rb");
+        result.ok = input != nullptr;
+      }
+      if (!result.ok) {
+        ++summary.skipped;
+        continue;
+      }
+
+      ContentReader content =
+          input != nullptr
+              ? hostContent(input)
+              : ContentReader([&result](char *buffer, size_t length,
+                                        uint64_t at) {
+                  std::memcpy(buffer, result.data.data() + at, length);
+                  return true;
+                });
+      if (const Metadata *duplicate = findDuplicate(result, content, archive)) {
+        if (input != nullptr) {
+          std::fclose(input);
+        }
+        addLinkToArchive(writer, hostFile.path, duplicate->path);
+        uint64_t offset = duplicate->offset;
+        imported.emplace_back(hostFile.path, result.size, FileType::REG,
+                              offset);
+        ++summary.files;
+        ++summary.deduplicated;
+        summary.bytes += result.size;
+        continue;
+      }
+
+      archive_entry_clear(entry);
+      archive_entry_set_pathname(entry, hostFile.path.c_str());
+      archive_entry_set_size(entry, result.size);
+      archive_entry_set_filetype(entry, AE_IFREG);
+      archive_entry_set_perm(entry,
+                             static_cast<int>(result.perms) & 0777);
+      if (archive_write_header(writer, entry) != ARCHIVE_OK) {
+        if (input != nullptr) {
+          std::fclose(input);
+        }
+        throw std::runtime_error("Failed to write header for " +
+                                 hostFile.path);
+      }
+      uint64_t offset = dataEnd + archive_filter_bytes(writer, 0);
+
+      if (input != nullptr) {
+        // Too large to buffer: stream it, zero-padded by libarchive should
+        // the file shrink meanwhile.
+        buffer.resize(kCopyBufferSize);
+        size_t read;
+        std::rewind(input);
+        while ((read = std::fread(buffer.data(), 1, buffer.size(), input)) >
+               0) {
+          if (archive_write_data(writer, buffer.data(), read) !=
+              static_cast<la_ssize_t>(read)) {
+            std::fclose(input);
+            throw std::runtime_error("Failed to write data for " +
+                                     hostFile.path);
+          }
+        }
+        std::fclose(input);
+      } else if (!result.data.empty() &&
+                 archive_write_data(writer, result.data.data(),
+                                    result.data.size()) !=
+                     static_cast<la_ssize_t>(result.data.size())) {
+        throw std::runtime_error("Failed to write data for " + hostFile.path);
+      }
+
+      importedContent.emplace(result.hash,
+                              std::make_pair(imported.size(), result.index));
+      imported.emplace_back(hostFile.path, result.size, FileType::REG, offset);
+      ++summary.files;
+      summary.bytes += result.size;
+    }
+    stopReaders();
+    // closeAppendWriter() releases both, whether or not it succeeds.
+    struct archive *finished = writer;
+    writer = nullptr;
+    closeAppendWriter(finished, file);
+  } catch (...) {
+    stopReaders();
+    archive_entry_free(entry);
+    if (writer != nullptr) {
+      archive_write_free(writer);
+      std::fclose(file);
+    }
+    if (archive != nullptr) {
+      std::fclose(archive);
+    }
+    throw;
+  }
+  archive_entry_free(entry);
+  std::fclose(archive);
+
+  fileStorage->addBatch(imported);
+  for (const auto &[hash, indices] : importedContent) {
+    contentIndex.emplace(hash, imported[indices.first].path);
+  }
+  lastMutation = std::chrono::steady_clock::now();
+  return summary;
+}
+
+void VirtualFilesystem::indexContent() {
+  if (contentIndexed) {
+    return;
+  }
+
+  // Only sizes are collected here, from the headers; a payload is hashed
+  // once an imported file of the same size could match it. Links add
+  // nothing as their target is collected already.
+  struct archive *reader = openArchiveReader(archivePath);
+  struct archive_entry *entry;
+  while (archive_read_next_header(reader, &entry) == ARCHIVE_OK) {
+    if (archive_entry_hardlink(entry) != nullptr ||
+        archive_entry_filetype(entry) != AE_IFREG) {
+      continue;
+    }
+    std::string path = storagePathOf(entry);
+    uint64_t offset = archive_filter_bytes(reader, 0);
+    if (fileStorage->exists(path) &&
+        fileStorage->getMetadata(path).offset == offset) {
+      unhashedPayloads[archive_entry_size(entry)].push_back(std::move(path));
+    }
+  }
+  instrumentation::archiveBytesRead.fetch_add(archive_filter_bytes(reader, -1),
+                                              std::memory_order_relaxed);
+  archive_read_free(reader);
+  contentIndexed = true;
+}
+
+void VirtualFilesystem::hashPayloads(uint64_t size, std::FILE *archive) {
+  auto bucket = unhashedPayloads.find(size);
+  if (bucket == unhashedPayloads.end()) {
+    return;
+  }
+
+  std::vector<char> buffer(std::min<uint64_t>(size, kCopyBufferSize));
+  for (const std::string &path : bucket->second) {
+    if (!fileStorage->exists(path)) {
+      continue;
+    }
+    const Metadata &metadata = fileStorage->getMetadata(path);
+    if (metadata.fileType != FileType::REG || metadata.size != size ||
+        metadata.offset == 0) {
+      continue;
+    }
+    ContentHash hash;
+    uint64_t done = 0;
+    while (done < size) {
+      size_t chunk = std::min<uint64_t>(size - done, buffer.size());
+      if (readAt(archive, buffer.data(), chunk, metadata.offset + done) !=
+          chunk) {
+        break;
+      }
+      hash.update(buffer.data(), chunk);
+      done += chunk;
+    }
+    instrumentation::archiveBytesRead.fetch_add(done,
+                                                std::memory_order_relaxed);
+    if (done == size) {
+      contentIndex.emplace(hash.digest(), path);
+    }
+  }
+  unhashedPayloads.erase(bucket);
+}
+
+ExportSummary VirtualFilesystem::exportDirectory(
+    const std::string &path, const std::string &hostDirectory,
+    unsigned threads) {
+  std::unique_lock<std::recursive_mutex> lock(mutex);
+  compactionDone.wait(lock, [this] { return !compacting; });
+  bool isDirectory = false;
+  std::string root = normalizePath(path, isDirectory);
+  if (!fileStorage->exists(root)) {
+    throw std::runtime_error("No such file or directory: " + path);
+  }
+  // Offsets of journaled entries are only known once they are folded.
+  foldJournal();
+
+  ExportSummary summary;
+  std::vector<Metadata> files;
+  std::filesystem::path hostRoot(hostDirectory);
+  std::filesystem::create_directories(hostRoot);
+  auto hostPathOf = [&](const std::string &entryPath) {
+    if (!isDirectory) {
+      return hostRoot / entryPath.substr(entryPath.find_last_of('/') + 1);
+    }
+    return hostRoot / entryPath.substr(root == "/" ? 1 : root.size() + 1);
+  };
+
+  if (isDirectory) {
+    std::vector<std::string> pending{root};
+    while (!pending.empty()) {
+      std::string directory = std::move(pending.back());
+      pending.pop_back();
+      const std::string prefix = directory == "/" ? "/" : directory + "/";
+      for (const std::string &child : fileStorage->listChildren(directory)) {
+        const Metadata &metadata = fileStorage->getMetadata(prefix + child);
+        if (metadata.fileType == FileType::DIR) {
+          std::filesystem::create_directory(hostPathOf(metadata.path));
+          pending.push_back(metadata.path);
+          ++summary.directories;
+        } else {
+          files.push_back(metadata);
+        }
+      }
+    }
+  } else {
+    files.push_back(fileStorage->getMetadata(root));
+  }
+
+  // Handing out files in archive order keeps the reads close to sequential.
+  std::sort(files.begin(), files.end(),
+            [](const Metadata &a, const Metadata &b) {
+              return a.offset < b.offset;
+            });
+
+  std::atomic<size_t> nextFile{0};
+  std::atomic<uint64_t> bytesRead{0};
+  std::mutex errorMutex;
+  std::string error;
+  auto writeFiles = [&]() {
+    std::FILE *archive = std::fopen(archivePath.c_str(), "rb");
+    if (archive == nullptr) {
+      std::lock_guard<std::mutex> errorLock(errorMutex);
+      error = "Failed to open archive for reading";
+      return;
+    }
+    std::vector<char> buffer;
+    size_t index;
+    while ((index = nextFile++) < files.size()) {
+      {
+        std::lock_guard<std::mutex> errorLock(errorMutex);
+        if (!error.empty()) {
+          break;
+        }
+      }
+      const Metadata &metadata = files[index];
+      std::filesystem::path hostPath = hostPathOf(metadata.path);
+      std::FILE *output = std::fopen(hostPath.string().c_str(), "wb");
+      bool ok = output != nullptr;
+      for (uint64_t done = 0; ok && done < metadata.size;) {
+        size_t chunk = std::min<uint64_t>(metadata.size - done,
+                                          kCopyBufferSize);
+        buffer.resize(std::max(buffer.size(), chunk));
+        ok = readAt(archive, buffer.data(), chunk, metadata.offset + done) ==
+                 chunk &&
+             std::fwrite(buffer.data(), 1, chunk, output) == chunk;
+        done += chunk;
+      }
+      if (output != nullptr && std::fclose(output) != 0) {
+        ok = false;
+      }
+      if (!ok) {
+        std::lock_guard<std::mutex> errorLock(errorMutex);
+        error = "Failed to export " + metadata.path + " to " +
+                hostPath.string();
+        break;
+      }
+      bytesRead.fetch_add(metadata.size, std::memory_order_relaxed);
+    }
+    std::fclose(archive);
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> writers;
+  for (unsigned i = 1; i < threads && i < files.size(); ++i) {
+    writers.emplace_back(writeFiles);
+  }
+  writeFiles();
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  instrumentation::archiveBytesRead.fetch_add(bytesRead,
+                                              std::memory_order_relaxed);
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+
+  summary.files = files.size();
+  summary.bytes = bytesRead;
+  return summary;
 }
 
 std::string VirtualFilesystem::getCurrentDirectory() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   return currentDirectory;
 }
 
 std::string VirtualFilesystem::normalizePath(const std::string &path,
                                              bool &isDirectory) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   std::string targetPath = path;
 
   if (targetPath.empty() || targetPath == ".") {
@@ -208,15 +1563,6 @@ std::string VirtualFilesystem::normalizePath(const std::string &path,
     }
   }
 
-  if (targetPath == "..") {
-    if (currentDirectory == "/") {
-      targetPath = currentDirectory;
-    } else {
-      size_t lastSlashPos = currentDirectory.find_last_of('/');
-      targetPath = currentDirectory.substr(0, lastSlashPos);
-    }
-  }
-
   std::vector<std::string> pathSegments;
   std::stringstream ss(targetPath);
   std::string segment;
@@ -253,6 +1599,7 @@ std::string VirtualFilesystem::normalizePath(const std::string &path,
 }
 
 bool VirtualFilesystem::changeDirectory(const std::string &path) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   bool isDirectory = false;
   std::string targetPath = normalizePath(path, isDirectory);
 
@@ -268,6 +1615,7 @@ bool VirtualFilesystem::changeDirectory(const std::string &path) {
 std::vector<std::string>
 VirtualFilesystem::listDirectory(const std::string &path,
                                  std::string &errorMessage) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   std::vector<std::string> result;
 
   bool isDirectory = false;
@@ -278,34 +1626,123 @@ VirtualFilesystem::listDirectory(const std::string &path,
     return result;
   }
 
-  if (directoryPath.back() != '/') {
-    directoryPath += '/';
+  const auto &children = fileStorage->listChildren(directoryPath);
+  result.assign(children.begin(), children.end());
+  return result;
+}
+
+std::string VirtualFilesystem::readFile(const std::string &path,
+                                        std::string &errorMessage) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  bool isDirectory = false;
+  std::string filePath = normalizePath(path, isDirectory);
+  if (!fileStorage->exists(filePath)) {
+    errorMessage = "No such file or directory";
+    return "";
+  }
+  if (isDirectory) {
+    errorMessage = "Is a directory";
+    return "";
   }
+  // Pending copies already point at their source's payload; only files
+  // added without content and not folded yet have none in the archive.
+  const Metadata &metadata = fileStorage->getMetadata(filePath);
+  std::string content(metadata.size, '\0');
+  if (metadata.offset == 0) {
+    kPlaceholder.copy(content.data(), content.size());
+    return content;
+  }
+  if (content.empty()) {
+    return content;
+  }
+  std::FILE *archive = std::fopen(archivePath.c_str(), "rb");
+  if (archive == nullptr) {
+    errorMessage = "Failed to open archive for reading";
+    return "";
+  }
+  auto load = [archive](char *buffer, size_t length, uint64_t offset) {
+    size_t read = readAt(archive, buffer, length, offset);
+    instrumentation::archiveBytesRead.fetch_add(read,
+                                                std::memory_order_relaxed);
+    return read;
+  };
+  // Block-sized requests let the cache see the file as a sequential read.
+  for (uint64_t done = 0; done < content.size();) {
+    size_t chunk = std::min<uint64_t>(content.size() - done,
+                                      BlockCache::kBlockSize);
+    if (blockCache.read(metadata.offset + done, chunk, &content[done],
+                        load) != chunk) {
+      std::fclose(archive);
+      errorMessage = "Unexpected end of archive";
+      return "";
+    }
+    done += chunk;
+  }
+  std::fclose(archive);
+  return content;
+}
 
-  for (const auto &file : fileStorage->files) {
-    const std::string &filePath = file.second.path;
+void VirtualFilesystem::setCacheBudget(uint64_t bytes) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  blockCache.setBudget(bytes);
+}
 
-    if (filePath.find(directoryPath) == 0) {
-      std::string relativePath = filePath.substr(directoryPath.size());
+BlockCacheStats VirtualFilesystem::getCacheStats() const {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  return blockCache.stats();
+}
 
-      if (!relativePath.empty() &&
-          relativePath.find('/') == std::string::npos) {
-        result.push_back(relativePath);
-      } else if (!relativePath.empty() && relativePath.back() == '/' &&
-                 relativePath.find('/', 0) == relativePath.size() - 1) {
-        result.push_back(relativePath.substr(0, relativePath.size() - 1));
-      }
-    }
+std::vector<std::string>
+VirtualFilesystem::completePath(const std::string &partial, size_t limit) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  std::vector<std::string> completions;
+  size_t slash = partial.find_last_of('/');
+  std::string typedDirectory =
+      slash == std::string::npos ? "" : partial.substr(0, slash + 1);
+  std::string prefix = partial.substr(typedDirectory.size());
+
+  bool isDirectory = false;
+  std::string directory = normalizePath(
+      typedDirectory.empty() ? "." : typedDirectory, isDirectory);
+  if (!isDirectory) {
+    return completions;
   }
 
-  return result;
+  const auto &children = fileStorage->listChildren(directory);
+  const std::string base = directory == "/" ? "/" : directory + "/";
+  for (auto it = children.lower_bound(prefix);
+       it != children.end() && completions.size() < limit &&
+       it->compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    bool isChildDirectory =
+        fileStorage->getMetadata(base + *it).fileType == FileType::DIR;
+    completions.push_back(typedDirectory + *it + (isChildDirectory ? "/" : ""));
+  }
+  return completions;
 }
 
 bool VirtualFilesystem::existsInStorage(const std::string &path) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   return fileStorage->exists(path);
 }
 
-const Metadata &
+Metadata
 VirtualFilesystem::getMetadataFromStorage(const std::string &path) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
   return fileStorage->getMetadata(path);
+}
+
+std::optional<Metadata>
+VirtualFilesystem::findInStorage(const std::string &path) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  if (!fileStorage->exists(path)) {
+    return std::nullopt;
+  }
+  return fileStorage->getMetadata(path);
+}
+
+DirectoryTotals
+VirtualFilesystem::getTotalsFromStorage(const std::string &path) const {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  return fileStorage->getTotals(path);
 }
\ No newline at end of file
@@ -1,10 +1,21 @@
 #include "commands/command.hpp"
+#include "core/block_cache.hpp"
+#include "core/file_watcher.hpp"
+#include "core/history.hpp"
+#include "core/journal.hpp"
+#include "core/parser.hpp"
 #include "core/virtual_filesystem.hpp"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <archive.h>
+#include <archive_entry.h>
 #include <boost/filesystem.hpp>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <memory>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 std::string sortLines(const std::string &input) {
@@ -25,6 +36,64 @@ std::string sortLines(const std::string &input) {
   return sortedStream.str();
 }
 
+// Names ending in '/' are directories, "name -> target" are hard links and
+// everything else is a file holding its own name.
+void writeTestEntries(struct archive *writer,
+                      const std::vector<std::string> &files) {
+  for (const std::string &file : files) {
+    bool isDirectory = file.back() == '/';
+    size_t arrow = file.find(" -> ");
+    struct archive_entry *entry = archive_entry_new();
+    archive_entry_set_pathname(entry, file.substr(0, arrow).c_str());
+    archive_entry_set_size(entry, isDirectory || arrow != std::string::npos
+                                      ? 0
+                                      : file.size());
+    archive_entry_set_filetype(entry, isDirectory ? AE_IFDIR : AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+    if (arrow != std::string::npos) {
+      archive_entry_set_hardlink(entry, file.substr(arrow + 4).c_str());
+    }
+    archive_write_header(writer, entry);
+    if (!isDirectory && arrow == std::string::npos) {
+      archive_write_data(writer, file.data(), file.size());
+    }
+    archive_entry_free(entry);
+  }
+  archive_write_close(writer);
+  archive_write_free(writer);
+}
+
+void writeTestArchive(const std::string &path,
+                      const std::vector<std::string> &files) {
+  struct archive *writer = archive_write_new();
+  archive_write_set_format_pax_restricted(writer);
+  archive_write_open_filename(writer, path.c_str());
+  writeTestEntries(writer, files);
+}
+
+// Appends like `tar -r`: the new entries overwrite the end-of-archive marker.
+void appendTestArchive(const std::string &path,
+                       const std::vector<std::string> &files) {
+  struct archive *reader = archive_read_new();
+  archive_read_support_format_tar(reader);
+  archive_read_open_filename(reader, path.c_str(), 10240);
+  struct archive_entry *entry;
+  long end = 0;
+  while (archive_read_next_header(reader, &entry) == ARCHIVE_OK) {
+    archive_read_data_skip(reader);
+    end = archive_filter_bytes(reader, 0);
+  }
+  archive_read_free(reader);
+
+  std::FILE *file = std::fopen(path.c_str(), "r+b");
+  std::fseek(file, end, SEEK_SET);
+  struct archive *writer = archive_write_new();
+  archive_write_set_format_pax_restricted(writer);
+  archive_write_open_FILE(writer, file);
+  writeTestEntries(writer, files);
+  std::fclose(file);
+}
+
 class VirtualFilesystemTest : public ::testing::Test {
 protected:
   std::shared_ptr<VirtualFilesystem> vfs;
@@ -106,6 +175,39 @@ TEST_F(VirtualFilesystemTest, TestCopyFileTargetExists) {
   EXPECT_EQ(cpCommand.execute(args), "cp: target already exists: /dir1/file1");
 }
 
+TEST_F(VirtualFilesystemTest, TestCopyDirectoryCommitsOnce) {
+  for (int i = 0; i < 50; ++i) {
+    vfs->addFileToArchiveAndStorage("/dir1/f" + std::to_string(i), 1,
+                                    FileType::REG);
+  }
+  vfs->addFileToArchiveAndStorage("/dir1/sub", 0, FileType::DIR);
+
+  CpCommand cpCommand(vfs);
+  uint64_t syncsBefore = instrumentation::journalSyncs.load();
+  EXPECT_EQ(cpCommand.execute({"/dir1", "/dir2/copy"}), "");
+  EXPECT_LE(instrumentation::journalSyncs.load() - syncsBefore, 2u);
+  EXPECT_TRUE(vfs->existsInStorage("/dir2/copy/f49"));
+  EXPECT_TRUE(vfs->existsInStorage("/dir2/copy/sub"));
+}
+
+TEST_F(VirtualFilesystemTest, TestConcurrentMutationsShareCommits) {
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back([this, t] {
+      for (int i = 0; i < 50; ++i) {
+        EXPECT_TRUE(vfs->addFileToArchiveAndStorage(
+            "/dir1/t" + std::to_string(t) + "-" + std::to_string(i), 0,
+            FileType::REG));
+      }
+    });
+  }
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  std::string errorMessage;
+  EXPECT_EQ(vfs->listDirectory("/dir1", errorMessage).size(), 200u);
+}
+
 // command: tree
 TEST_F(VirtualFilesystemTest, TestTreeCommandEmpty) {
   TreeCommand treeCommand(vfs);
@@ -146,4 +248,889 @@ TEST_F(VirtualFilesystemTest, TestFindCommandTooManyArguments) {
   FindCommand findCommand(vfs);
   std::vector<std::string> args = {"file1", "extra"};
   EXPECT_EQ(findCommand.execute(args), "find: missing argument");
-}
\ No newline at end of file
+}
+
+// command: compact
+TEST_F(VirtualFilesystemTest, TestCompactDropsDuplicates) {
+  std::string dupPath = "dup.tar";
+  writeTestArchive(dupPath, {"/a", "/b", "/a", "/b"});
+  uint64_t sizeBefore = boost::filesystem::file_size(dupPath);
+  auto dupVfs = std::make_shared<VirtualFilesystem>(dupPath);
+  {
+    CompactCommand compactCommand(dupVfs);
+    EXPECT_EQ(compactCommand.execute({}).rfind("compact: reclaimed ", 0), 0u);
+  }
+  dupVfs.reset();
+  EXPECT_LT(boost::filesystem::file_size(dupPath), sizeBefore);
+
+  dupVfs = std::make_shared<VirtualFilesystem>(dupPath);
+  ListDirectoryCommand lsCommand(dupVfs);
+  EXPECT_EQ(sortLines(lsCommand.execute({"/"})), sortLines("a\nb"));
+  EXPECT_EQ(dupVfs->compact(), 0u);
+  dupVfs.reset();
+  boost::filesystem::remove(dupPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestIdleCompaction) {
+  std::string dupPath = "dup.tar";
+  writeTestArchive(dupPath, {"/a", "/a"});
+  uint64_t sizeBefore = boost::filesystem::file_size(dupPath);
+  auto dupVfs = std::make_shared<VirtualFilesystem>(dupPath);
+  dupVfs->setIdleCompactionDelay(std::chrono::milliseconds(10));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (boost::filesystem::file_size(dupPath) >= sizeBefore &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_LT(boost::filesystem::file_size(dupPath), sizeBefore);
+  dupVfs.reset();
+  boost::filesystem::remove(dupPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestCompactKeepsAppending) {
+  {
+    CpCommand cpCommand(vfs);
+    EXPECT_EQ(cpCommand.execute({"/hello", "/dir/hello"}), "");
+    vfs->compact();
+    EXPECT_EQ(cpCommand.execute({"/hello", "/hello2"}), "");
+  }
+  vfs.reset();
+
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  EXPECT_TRUE(vfs->existsInStorage("/dir/hello"));
+  EXPECT_TRUE(vfs->existsInStorage("/hello2"));
+  EXPECT_EQ(vfs->getMetadataFromStorage("/hello2").size,
+            std::strlen("Hello, world!"));
+}
+
+TEST_F(VirtualFilesystemTest, TestCompactTooManyArguments) {
+  CompactCommand compactCommand(vfs);
+  EXPECT_EQ(compactCommand.execute({"extra"}), "compact: too many arguments");
+}
+
+// command: rm
+TEST_F(VirtualFilesystemTest, TestRemoveFile) {
+  RemoveCommand rmCommand(vfs);
+  EXPECT_EQ(rmCommand.execute({"/hello"}), "");
+  EXPECT_FALSE(vfs->existsInStorage("/hello"));
+}
+
+TEST_F(VirtualFilesystemTest, TestRemoveNonEmptyDirectory) {
+  RemoveCommand rmCommand(vfs);
+  EXPECT_EQ(rmCommand.execute({"/dir"}),
+            "rm: cannot remove '/dir': Directory not empty");
+}
+
+TEST_F(VirtualFilesystemTest, TestRemoveNotFound) {
+  RemoveCommand rmCommand(vfs);
+  EXPECT_EQ(rmCommand.execute({"/nonexistent"}),
+            "rm: cannot remove '/nonexistent': No such file or directory");
+}
+
+TEST_F(VirtualFilesystemTest, TestRemovePersists) {
+  {
+    RemoveCommand rmCommand(vfs);
+    EXPECT_EQ(rmCommand.execute({"/dir/file"}), "");
+  }
+  vfs.reset();
+
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  EXPECT_FALSE(vfs->existsInStorage("/dir/file"));
+  EXPECT_TRUE(vfs->existsInStorage("/dir/dir2"));
+}
+
+// journal
+size_t countArchiveEntries(const std::string &path, const std::string &name) {
+  struct archive *reader = archive_read_new();
+  archive_read_support_format_tar(reader);
+  archive_read_open_filename(reader, path.c_str(), 10240);
+  size_t entries = 0;
+  struct archive_entry *entry;
+  while (archive_read_next_header(reader, &entry) == ARCHIVE_OK) {
+    entries += name == archive_entry_pathname(entry);
+  }
+  archive_read_free(reader);
+  return entries;
+}
+
+TEST_F(VirtualFilesystemTest, TestRemovalWaitsForCompaction) {
+  EXPECT_TRUE(vfs->removeFromArchiveAndStorage("/dir/file"));
+  EXPECT_TRUE(vfs->copyInArchiveAndStorage("/hello", "/copy"));
+  vfs.reset();
+
+  // Folding appended the copy but left the removed entry for compaction;
+  // the journal carries the removal over to the next mount.
+  EXPECT_EQ(countArchiveEntries(archivePath, "/dir/file"), 1u);
+  EXPECT_EQ(countArchiveEntries(archivePath, "/copy"), 1u);
+  EXPECT_TRUE(boost::filesystem::exists(archivePath + ".journal"));
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  EXPECT_FALSE(vfs->existsInStorage("/dir/file"));
+  EXPECT_TRUE(vfs->existsInStorage("/copy"));
+
+  vfs->compact();
+  EXPECT_EQ(countArchiveEntries(archivePath, "/dir/file"), 0u);
+  vfs.reset();
+  EXPECT_FALSE(boost::filesystem::exists(archivePath + ".journal"));
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  EXPECT_FALSE(vfs->existsInStorage("/dir/file"));
+}
+
+TEST_F(VirtualFilesystemTest, TestJournalReplayedOnStartup) {
+  EXPECT_TRUE(vfs->copyInArchiveAndStorage("/hello", "/hello2"));
+
+  // The first instance has not folded its journal, as after a crash.
+  VirtualFilesystem recovered(archivePath);
+  EXPECT_TRUE(recovered.existsInStorage("/hello2"));
+  EXPECT_EQ(recovered.getMetadataFromStorage("/hello2").size,
+            std::strlen("Hello, world!"));
+}
+
+TEST_F(VirtualFilesystemTest, TestJournalDropsTornTail) {
+  std::string journalPath = "torn.journal";
+  boost::filesystem::remove(journalPath);
+  {
+    Journal journal(journalPath);
+    journal.commit(journal.append({JournalOp::ADD, FileType::REG, 5, "/a", ""}));
+    journal.commit(
+        journal.append({JournalOp::COPY, FileType::REG, 5, "/b", "/a"}));
+  }
+  boost::filesystem::resize_file(journalPath,
+                                 boost::filesystem::file_size(journalPath) - 1);
+
+  auto records = Journal::replay(journalPath);
+  ASSERT_EQ(records.size(), 1u);
+  EXPECT_EQ(records[0].path, "/a");
+  EXPECT_EQ(records[0].size, 5u);
+  boost::filesystem::remove(journalPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestJournalResetKeepsRecords) {
+  std::string journalPath = "reset.journal";
+  boost::filesystem::remove(journalPath);
+  {
+    Journal journal(journalPath);
+    journal.commit(journal.append({JournalOp::ADD, FileType::REG, 5, "/a", ""}));
+    journal.reset({{JournalOp::REMOVE, FileType::REG, 0, "/gone", ""}});
+    EXPECT_FALSE(boost::filesystem::exists(journalPath + ".tmp"));
+
+    // A reset that fails leaves the old journal in place and usable.
+    boost::filesystem::create_directory(journalPath + ".tmp");
+    boost::filesystem::create_directory(journalPath + ".tmp/x");
+    EXPECT_THROW(journal.reset(), std::runtime_error);
+    boost::filesystem::remove_all(journalPath + ".tmp");
+    journal.commit(
+        journal.append({JournalOp::COPY, FileType::REG, 5, "/b", "/a"}));
+  }
+
+  auto records = Journal::replay(journalPath);
+  ASSERT_EQ(records.size(), 2u);
+  EXPECT_EQ(records[0].op, JournalOp::REMOVE);
+  EXPECT_EQ(records[0].path, "/gone");
+  EXPECT_EQ(records[1].path, "/b");
+  boost::filesystem::remove(journalPath);
+}
+
+// command: stats
+TEST_F(VirtualFilesystemTest, TestStatsCountsCommands) {
+  auto metrics = std::make_shared<instrumentation::CommandMetrics>();
+  Parser parser(vfs, metrics);
+  parser.processCommand("ls /");
+  parser.processCommand("ls /dir");
+  parser.processCommand("cd /dir1");
+
+  std::string json = metrics->toJson();
+  EXPECT_NE(json.find("\"ls\":{\"calls\":2,"), std::string::npos);
+  EXPECT_NE(json.find("\"cd\":{\"calls\":1,"), std::string::npos);
+  EXPECT_EQ(json.find("\"storage_lookups\":0,"), std::string::npos);
+
+  std::string report = parser.processCommand("stats");
+  EXPECT_EQ(report.rfind("command", 0), 0u);
+  EXPECT_NE(report.find("\nls "), std::string::npos);
+}
+
+TEST_F(VirtualFilesystemTest, TestRefreshIsNotCounted) {
+  auto metrics = std::make_shared<instrumentation::CommandMetrics>();
+  Parser parser(vfs, metrics);
+  parser.processCommand("ls /");
+  EXPECT_EQ(parser.refreshCommand("ls /"), parser.processCommand("ls /"));
+  EXPECT_NE(metrics->toJson().find("\"ls\":{\"calls\":2,"),
+            std::string::npos);
+}
+
+TEST_F(VirtualFilesystemTest, TestStatsReset) {
+  Parser parser(vfs);
+  parser.processCommand("ls /");
+  EXPECT_EQ(parser.processCommand("stats reset"), "");
+  std::string json = parser.processCommand("stats json");
+  EXPECT_EQ(json.rfind("{\"commands\":{\"stats\":{\"calls\":1,", 0), 0u);
+  EXPECT_EQ(json.find("\"ls\""), std::string::npos);
+}
+
+TEST_F(VirtualFilesystemTest, TestAlignedAllocationsAreCounted) {
+  struct alignas(64) Line {
+    char bytes[64];
+  };
+  uint64_t before = instrumentation::allocations.load();
+  auto line = std::make_unique<Line>();
+  auto lines = std::make_unique<Line[]>(4);
+  EXPECT_GE(instrumentation::allocations.load() - before, 2u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(line.get()) % 64, 0u);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(lines.get()) % 64, 0u);
+}
+
+// lazy index
+TEST_F(VirtualFilesystemTest, TestLazyIndexListsNestedDirectories) {
+  std::string lazyPath = "lazy.tar";
+  writeTestArchive(lazyPath, {"/a/", "/a/b/", "/a/b/c", "/a/b.txt", "/a/b0",
+                              "/a/b/d/", "/a/b/d/e", "/z"});
+  {
+    auto lazyVfs = std::make_shared<VirtualFilesystem>(lazyPath);
+    ListDirectoryCommand lsCommand(lazyVfs);
+    EXPECT_EQ(lsCommand.execute({"/a/b/d"}), "e");
+    EXPECT_EQ(lsCommand.execute({"/a"}), "b\nb.txt\nb0");
+    EXPECT_EQ(lsCommand.execute({"/"}), "a\nz");
+    EXPECT_EQ(lazyVfs->getMetadataFromStorage("/a/b/c").size,
+              std::string("/a/b/c").size());
+  }
+  boost::filesystem::remove(lazyPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestLazyIndexKeepsLastDuplicate) {
+  std::string lazyPath = "lazy.tar";
+  writeTestArchive(lazyPath, {"/d/", "/d/f", "/d/", "/d/f"});
+  {
+    auto lazyVfs = std::make_shared<VirtualFilesystem>(lazyPath);
+    ListDirectoryCommand lsCommand(lazyVfs);
+    EXPECT_EQ(lsCommand.execute({"/d"}), "f");
+    EXPECT_TRUE(lazyVfs->existsInStorage("/d/f"));
+    EXPECT_FALSE(lazyVfs->existsInStorage("/d/g"));
+  }
+  boost::filesystem::remove(lazyPath);
+}
+
+// commands: du, stat
+TEST_F(VirtualFilesystemTest, TestDiskUsage) {
+  DiskUsageCommand duCommand(vfs);
+  EXPECT_EQ(duCommand.execute({"/"}), "13\t/");
+  EXPECT_EQ(duCommand.execute({"/hello"}), "13\t/hello");
+  EXPECT_EQ(duCommand.execute({"/nonexistent"}),
+            "du: cannot access '/nonexistent': No such file or directory");
+}
+
+TEST_F(VirtualFilesystemTest, TestDiskUsageFollowsMutations) {
+  DiskUsageCommand duCommand(vfs);
+  CpCommand cpCommand(vfs);
+  RemoveCommand rmCommand(vfs);
+  EXPECT_EQ(cpCommand.execute({"/hello", "/dir/dir2/hello"}), "");
+  EXPECT_EQ(duCommand.execute({"/dir"}), "13\t/dir");
+  EXPECT_EQ(duCommand.execute({"/"}), "26\t/");
+  EXPECT_EQ(rmCommand.execute({"/hello"}), "");
+  EXPECT_EQ(duCommand.execute({"/"}), "13\t/");
+}
+
+TEST_F(VirtualFilesystemTest, TestStatDirectory) {
+  StatCommand statCommand(vfs);
+  EXPECT_EQ(statCommand.execute({"/dir"}),
+            "File: /dir\nType: directory\nSize: 0\nTotal: 0\nFiles: 1\n"
+            "Directories: 1");
+  EXPECT_EQ(statCommand.execute({"/hello"}),
+            "File: /hello\nType: regular file\nSize: 13");
+}
+
+TEST_F(VirtualFilesystemTest, TestStatLoadedArchive) {
+  std::string lazyPath = "lazy.tar";
+  writeTestArchive(lazyPath, {"/a/", "/a/b/", "/a/b/c", "/a/b.txt", "/z"});
+  {
+    auto lazyVfs = std::make_shared<VirtualFilesystem>(lazyPath);
+    StatCommand statCommand(lazyVfs);
+    EXPECT_EQ(statCommand.execute({"/a"}),
+              "File: /a\nType: directory\nSize: 0\nTotal: 14\nFiles: 2\n"
+              "Directories: 1");
+    EXPECT_TRUE(lazyVfs->copyInArchiveAndStorage("/z", "/a/b/z"));
+    EXPECT_EQ(lazyVfs->getTotalsFromStorage("/").files, 4u);
+    EXPECT_EQ(lazyVfs->getTotalsFromStorage("/a/b").bytes, 8u);
+  }
+  boost::filesystem::remove(lazyPath);
+}
+
+// command: import
+TEST_F(VirtualFilesystemTest, TestImportDirectory) {
+  std::string hostPath = "import-src";
+  boost::filesystem::remove_all(hostPath);
+  boost::filesystem::create_directories(hostPath + "/sub/deep");
+  std::ofstream(hostPath + "/top.txt") << "top";
+  std::ofstream(hostPath + "/sub/a.txt") << "alpha";
+  std::ofstream(hostPath + "/sub/deep/b.txt") << "bravo!";
+  std::ofstream(hostPath + "/dir") << "clash";
+
+  {
+    ImportCommand importCommand(vfs);
+    EXPECT_EQ(importCommand.execute({hostPath, "/"}),
+              "import: 3 files, 2 directories, 14 bytes, 1 skipped");
+    EXPECT_EQ(importCommand.execute({hostPath, "/hello"}),
+              "import: Not a directory: /hello");
+  }
+  EXPECT_EQ(vfs->getTotalsFromStorage("/sub").bytes, 11u);
+
+  // Recorded offsets point at the imported content.
+  Metadata metadata = vfs->getMetadataFromStorage("/sub/deep/b.txt");
+  std::ifstream archive(archivePath, std::ios::binary);
+  archive.seekg(metadata.offset);
+  std::string content(metadata.size, '\0');
+  archive.read(content.data(), content.size());
+  EXPECT_EQ(content, "bravo!");
+
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  ListDirectoryCommand lsCommand(vfs);
+  EXPECT_EQ(lsCommand.execute({"/sub"}), "a.txt\ndeep");
+  EXPECT_EQ(vfs->getMetadataFromStorage("/top.txt").size, 3u);
+  EXPECT_EQ(vfs->getTotalsFromStorage("/").files, 5u);
+  boost::filesystem::remove_all(hostPath);
+}
+
+std::string readHostFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+TEST_F(VirtualFilesystemTest, TestExportDirectory) {
+  std::string hostPath = "export-src";
+  std::string exportPath = "export-dst";
+  boost::filesystem::remove_all(hostPath);
+  boost::filesystem::remove_all(exportPath);
+  boost::filesystem::create_directories(hostPath + "/sub/deep");
+  std::ofstream(hostPath + "/sub/a.txt") << "alpha";
+  std::ofstream(hostPath + "/sub/deep/b.txt") << std::string(3 << 20, 'b');
+  vfs->importDirectory(hostPath, "/dir");
+
+  ExportCommand exportCommand(vfs);
+  EXPECT_EQ(exportCommand.execute({"/dir", exportPath}),
+            "export: 3 files, 3 directories, 3145733 bytes");
+  EXPECT_EQ(readHostFile(exportPath + "/sub/a.txt"), "alpha");
+  EXPECT_EQ(readHostFile(exportPath + "/sub/deep/b.txt"),
+            std::string(3 << 20, 'b'));
+  EXPECT_TRUE(boost::filesystem::is_directory(exportPath + "/dir2"));
+
+  // Offsets follow entries through journal folds and compaction.
+  EXPECT_TRUE(vfs->copyInArchiveAndStorage("/hello", "/copy"));
+  EXPECT_TRUE(vfs->removeFromArchiveAndStorage("/dir/file"));
+  vfs->compact();
+  EXPECT_EQ(exportCommand.execute({"/copy", exportPath}),
+            "export: 1 files, 0 directories, 13 bytes");
+  EXPECT_EQ(readHostFile(exportPath + "/copy"), "Hello, world!");
+  EXPECT_EQ(exportCommand.execute({"/dir/sub/a.txt", exportPath}),
+            "export: 1 files, 0 directories, 5 bytes");
+  EXPECT_EQ(readHostFile(exportPath + "/a.txt"), "alpha");
+  EXPECT_EQ(exportCommand.execute({"/missing", exportPath}),
+            "export: No such file or directory: /missing");
+
+  boost::filesystem::remove_all(hostPath);
+  boost::filesystem::remove_all(exportPath);
+}
+
+size_t countHardLinks(const std::string &path) {
+  struct archive *reader = archive_read_new();
+  archive_read_support_format_tar(reader);
+  archive_read_open_filename(reader, path.c_str(), 10240);
+  size_t links = 0;
+  struct archive_entry *entry;
+  while (archive_read_next_header(reader, &entry) == ARCHIVE_OK) {
+    links += archive_entry_hardlink(entry) != nullptr;
+  }
+  archive_read_free(reader);
+  return links;
+}
+
+TEST_F(VirtualFilesystemTest, TestImportDeduplicates) {
+  std::string hostPath = "dedup-src";
+  std::string exportPath = "dedup-dst";
+  boost::filesystem::remove_all(hostPath);
+  boost::filesystem::remove_all(exportPath);
+  boost::filesystem::create_directories(hostPath + "/sub");
+  std::string payload(100000, 'x');
+  std::ofstream(hostPath + "/a") << payload;
+  std::ofstream(hostPath + "/b") << payload;
+  std::ofstream(hostPath + "/sub/c") << payload;
+  std::ofstream(hostPath + "/d") << payload.substr(1) << 'y';
+
+  ImportCommand importCommand(vfs);
+  EXPECT_EQ(importCommand.execute({hostPath, "/dir"}),
+            "import: 4 files, 1 directories, 400000 bytes, 2 deduplicated");
+  EXPECT_LT(boost::filesystem::file_size(archivePath), 250000u);
+  EXPECT_EQ(importCommand.execute({hostPath, "/dir/dir2"}),
+            "import: 4 files, 1 directories, 400000 bytes, 4 deduplicated");
+  EXPECT_EQ(countHardLinks(archivePath), 6u);
+
+  // Removing the stored copy moves the bytes to a surviving link.
+  EXPECT_TRUE(vfs->removeFromArchiveAndStorage("/dir/a"));
+  vfs->compact();
+  EXPECT_LT(boost::filesystem::file_size(archivePath), 250000u);
+
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  EXPECT_EQ(vfs->getTotalsFromStorage("/dir").bytes, 700000u);
+  vfs->exportDirectory("/dir", exportPath);
+  EXPECT_EQ(readHostFile(exportPath + "/b"), payload);
+  EXPECT_EQ(readHostFile(exportPath + "/sub/c"), payload);
+  EXPECT_EQ(readHostFile(exportPath + "/dir2/sub/c"), payload);
+  EXPECT_EQ(readHostFile(exportPath + "/d"), payload.substr(1) + 'y');
+
+  boost::filesystem::remove_all(hostPath);
+  boost::filesystem::remove_all(exportPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestCopyStoresHardLink) {
+  std::string exportPath = "copy-dst";
+  EXPECT_TRUE(vfs->copyInArchiveAndStorage("/hello", "/copy"));
+  EXPECT_TRUE(vfs->copyInArchiveAndStorage("/copy", "/copy2"));
+  vfs->compact();
+  EXPECT_EQ(countHardLinks(archivePath), 2u);
+
+  // A link whose target is gone takes over the payload.
+  EXPECT_TRUE(vfs->removeFromArchiveAndStorage("/hello"));
+  vfs->compact();
+  EXPECT_EQ(countHardLinks(archivePath), 1u);
+  vfs = std::make_shared<VirtualFilesystem>(archivePath);
+  vfs->exportDirectory("/", exportPath);
+  EXPECT_EQ(readHostFile(exportPath + "/copy"), "Hello, world!");
+  EXPECT_EQ(readHostFile(exportPath + "/copy2"), "Hello, world!");
+  boost::filesystem::remove_all(exportPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestHardLinkResolvesToEarlierEntry) {
+  std::string linkPath = "links.tar";
+  std::string exportPath = "links-dst";
+  writeTestArchive(linkPath, {"/a", "/b -> /a", "/c -> /b", "/a",
+                              "/d -> /missing"});
+  {
+    auto linkVfs = std::make_shared<VirtualFilesystem>(linkPath);
+    EXPECT_EQ(linkVfs->getMetadataFromStorage("/c").size, 2u);
+    EXPECT_EQ(linkVfs->getMetadataFromStorage("/d").size, 0u);
+    linkVfs->exportDirectory("/", exportPath);
+    EXPECT_EQ(readHostFile(exportPath + "/b"), "/a");
+    EXPECT_EQ(readHostFile(exportPath + "/c"), "/a");
+  }
+  boost::filesystem::remove(linkPath);
+  boost::filesystem::remove_all(exportPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestParserDispatchesRegisteredCommands) {
+  Parser parser(vfs);
+  for (std::string_view name : Parser::Commands::names) {
+    EXPECT_NE(parser.processCommand(std::string(name)).rfind("Unknown", 0), 0u)
+        << name;
+  }
+  EXPECT_EQ(parser.processCommand("ls /dir"), "dir2\nfile");
+  EXPECT_EQ(parser.processCommand("lsx /"), "Unknown command: lsx");
+  EXPECT_EQ(parser.processCommand("l"), "Unknown command: l");
+  EXPECT_EQ(parser.processCommand(""), "Unknown command: ");
+}
+
+TEST_F(VirtualFilesystemTest, TestCompletion) {
+  Parser parser(vfs);
+  std::vector<std::string> candidates;
+  EXPECT_EQ(parser.complete("tr", candidates), "tree ");
+  EXPECT_EQ(parser.complete("st", candidates), "stat");
+  EXPECT_EQ(candidates, (std::vector<std::string>{"stat", "stats"}));
+  EXPECT_EQ(parser.complete("ls /d", candidates), "ls /dir");
+  EXPECT_EQ(candidates,
+            (std::vector<std::string>{"/dir/", "/dir1/", "/dir2/"}));
+  EXPECT_EQ(parser.complete("ls /dir/d", candidates), "ls /dir/dir2/");
+  EXPECT_EQ(parser.complete("ls /dir/", candidates), "ls /dir/");
+  EXPECT_EQ(candidates, (std::vector<std::string>{"/dir/dir2/", "/dir/file"}));
+  EXPECT_EQ(parser.complete("cp /dir/f", candidates), "cp /dir/file ");
+  EXPECT_EQ(parser.complete("ls /nope/x", candidates), "ls /nope/x");
+  EXPECT_TRUE(candidates.empty());
+
+  vfs->changeDirectory("/dir");
+  EXPECT_EQ(parser.complete("cd d", candidates), "cd dir2/");
+  EXPECT_EQ(parser.complete("cd ../h", candidates), "cd ../hello ");
+}
+
+TEST_F(VirtualFilesystemTest, TestCompletionInLargeDirectory) {
+  std::string widePath = "wide.tar";
+  std::vector<std::string> files = {"/w/"};
+  for (int i = 0; i < 100000; ++i) {
+    files.push_back("/w/f" + std::to_string(i));
+  }
+  writeTestArchive(widePath, files);
+  {
+    auto wideVfs = std::make_shared<VirtualFilesystem>(widePath);
+    EXPECT_EQ(wideVfs->completePath("/w/f9999").size(), 11u);
+    EXPECT_EQ(wideVfs->completePath("/w/f12345"),
+              std::vector<std::string>{"/w/f12345"});
+  }
+  boost::filesystem::remove(widePath);
+}
+
+TEST_F(VirtualFilesystemTest, TestHistoryPersistsAndNavigates) {
+  std::string historyPath = "history.txt";
+  boost::filesystem::remove(historyPath);
+  {
+    History history(historyPath);
+    history.add("ls /");
+    history.add("ls /");
+    history.add("   ");
+    history.add("cd /dir");
+  }
+  {
+    std::ofstream torn(historyPath, std::ios::app);
+    torn << "tree";
+  }
+  History history(historyPath);
+  history.add("pwd");
+  ASSERT_EQ(history.size(), 4u);
+  EXPECT_EQ(history.at(2), "tree");
+  EXPECT_EQ(history.previous(), std::string_view("pwd"));
+  EXPECT_EQ(history.previous(), std::string_view("tree"));
+  EXPECT_EQ(history.next(), std::string_view("pwd"));
+  EXPECT_EQ(history.next(), std::string_view());
+  EXPECT_EQ(history.next(), std::nullopt);
+  history.previous();
+  history.previous();
+  history.previous();
+  EXPECT_EQ(history.previous(), std::string_view("ls /"));
+  EXPECT_EQ(history.previous(), std::nullopt);
+  EXPECT_EQ(readHostFile(historyPath), "ls /\ncd /dir\ntree\npwd\n");
+  boost::filesystem::remove(historyPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestHistorySearch) {
+  std::string historyPath = "history.txt";
+  {
+    std::ofstream saved(historyPath, std::ios::trunc);
+    for (int i = 0; i < 100000; ++i) {
+      saved << "ls /dir" << i << "\n";
+    }
+  }
+  History history(historyPath);
+  history.add("cp /dir12345 /copy");
+  EXPECT_EQ(history.find("dir1234").size(), 12u);
+
+  HistorySearch search(history);
+  EXPECT_EQ(search.update("d"), std::string_view("cp /dir12345 /copy"));
+  EXPECT_EQ(search.update("dir12345"), std::string_view("cp /dir12345 /copy"));
+  EXPECT_EQ(search.older(), std::string_view("ls /dir12345"));
+  EXPECT_EQ(search.older(), std::nullopt);
+  EXPECT_EQ(search.update("dir99999"), std::string_view("ls /dir99999"));
+  EXPECT_EQ(search.update("copy /"), std::nullopt);
+  boost::filesystem::remove(historyPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestHistorySearchMatchesScan) {
+  // Lines over a tiny alphabet share most trigrams with any needle without
+  // holding it, so the index alone would overreport.
+  std::string historyPath = "history.txt";
+  {
+    std::ofstream saved(historyPath, std::ios::trunc);
+    uint32_t state = 12345;
+    for (int i = 0; i < 2000; ++i) {
+      state = state * 1103515245 + 12345;
+      for (uint32_t length = state >> 28; length > 0; --length) {
+        state = state * 1103515245 + 12345;
+        saved << "ab /"[state >> 30];
+      }
+      saved << "\n";
+    }
+    saved << "ab ab";
+  }
+  History history(historyPath);
+  history.add("abab /ba");
+  for (std::string needle :
+       {"a", "ab", "aba", "abab", "ab a", "b /b", "bbbb", "/ab ab", "xyz"}) {
+    std::vector<uint32_t> expected;
+    for (size_t i = 0; i < history.size(); ++i) {
+      if (history.at(i).find(needle) != std::string_view::npos) {
+        expected.push_back(i);
+      }
+    }
+    EXPECT_EQ(history.find(needle), expected) << needle;
+  }
+  boost::filesystem::remove(historyPath);
+}
+
+TEST_F(VirtualFilesystemTest, TestCat) {
+  CatCommand catCommand(vfs);
+  EXPECT_EQ(catCommand.execute({"/hello"}), "Hello, world!");
+  EXPECT_EQ(catCommand.execute({"/dir/file", "hello"}), "Hello, world!");
+  EXPECT_EQ(catCommand.execute({"/dir"}), "cat: /dir: Is a directory");
+  EXPECT_EQ(catCommand.execute({"/hello", "/nope"}),
+            "Hello, world!cat: /nope: No such file or directory");
+  EXPECT_EQ(catCommand.execute({}), "cat: missing operand");
+
+  // The block holding the old end of the archive is cached by now; appends
+  // and compaction rewrite it.
+  CpCommand cpCommand(vfs);
+  cpCommand.execute({"/hello", "/copy"});
+  vfs->addFileToArchiveAndStorage("/new", 5, FileType::REG);
+  EXPECT_EQ(catCommand.execute({"/copy"}), "Hello, world!");
+  EXPECT_EQ(catCommand.execute({"/new"}), "Hello");
+  vfs->removeFromArchiveAndStorage("/hello");
+  vfs->compact();
+  EXPECT_EQ(catCommand.execute({"/copy", "/new"}), "Hello, world!Hello");
+  EXPECT_GT(vfs->getCacheStats().hits, 0u);
+}
+
+TEST_F(VirtualFilesystemTest, TestCatLeavesJournalPending) {
+  CatCommand catCommand(vfs);
+  EXPECT_EQ(catCommand.execute({"/hello"}), "Hello, world!");
+  uint64_t archiveSize = boost::filesystem::file_size(archivePath);
+
+  vfs->removeFromArchiveAndStorage("/dir/file");
+  vfs->copyInArchiveAndStorage("/hello", "/copy");
+  vfs->addFileToArchiveAndStorage("/new", 5, FileType::REG);
+  vfs->addFileToArchiveAndStorage("/long", 15, FileType::REG);
+  EXPECT_EQ(catCommand.execute({"/copy", "/new", "/long"}),
+            std::string("Hello, world!HelloHello, world!\0\0", 33));
+  // Reads are served without folding, let alone compacting.
+  EXPECT_EQ(boost::filesystem::file_size(archivePath), archiveSize);
+  EXPECT_EQ(countArchiveEntries(archivePath, "/copy"), 0u);
+}
+
+TEST_F(VirtualFilesystemTest, TestBlockCacheReadAhead) {
+  size_t loads = 0;
+  auto load = [&](char *buffer, size_t length, uint64_t offset) {
+    ++loads;
+    for (size_t i = 0; i < length; ++i) {
+      buffer[i] = static_cast<char>((offset + i) % 251);
+    }
+    return length;
+  };
+  BlockCache cache(64 * BlockCache::kBlockSize);
+  std::vector<char> buffer(BlockCache::kBlockSize);
+  uint64_t offset = 1000;
+  for (int i = 0; i < 32; ++i, offset += buffer.size()) {
+    ASSERT_EQ(cache.read(offset, buffer.size(), buffer.data(), load),
+              buffer.size());
+    EXPECT_EQ(buffer.front(), static_cast<char>(offset % 251));
+    EXPECT_EQ(buffer.back(),
+              static_cast<char>((offset + buffer.size() - 1) % 251));
+  }
+  BlockCacheStats stats = cache.stats();
+  EXPECT_LT(loads, 8u);
+  EXPECT_GT(stats.readAheadHits, 16u);
+  EXPECT_LE(stats.bytes, stats.budget);
+}
+
+TEST_F(VirtualFilesystemTest, TestBlockCacheResistsScans) {
+  auto load = [](char *buffer, size_t length, uint64_t) {
+    std::memset(buffer, 0, length);
+    return length;
+  };
+  auto readBlock = [&](BlockCache &cache, uint64_t index) {
+    char byte;
+    cache.read(index * BlockCache::kBlockSize, 1, &byte, load);
+  };
+  BlockCache cache(8 * BlockCache::kBlockSize);
+  // A working set that is requested again after leaving probation moves to
+  // the protected queue.
+  for (uint64_t index : {0, 1, 2, 3, 10, 11, 12, 13, 14, 15, 16, 17, 0, 1,
+                         2, 3}) {
+    readBlock(cache, index);
+  }
+  EXPECT_EQ(cache.stats().ghostHits, 4u);
+
+  for (uint64_t index = 1000; index < 2000; ++index) {
+    readBlock(cache, index);
+  }
+  uint64_t hits = cache.stats().hits;
+  for (uint64_t index : {0, 1, 2, 3}) {
+    readBlock(cache, index);
+  }
+  EXPECT_EQ(cache.stats().hits, hits + 4);
+  EXPECT_LE(cache.stats().bytes, cache.stats().budget);
+
+  cache.invalidateFrom(2 * BlockCache::kBlockSize);
+  readBlock(cache, 1);
+  readBlock(cache, 2);
+  EXPECT_EQ(cache.stats().hits, hits + 5);
+}
+
+TEST_F(VirtualFilesystemTest, TestConcurrentReadsAndCopies) {
+  constexpr int kReaders = 4;
+  constexpr int kWriters = 2;
+  constexpr int kCopies = 100;
+  std::atomic<bool> writing{true};
+  std::atomic<int> readerFailures{0};
+  std::vector<std::thread> threads;
+
+  for (int reader = 0; reader < kReaders; ++reader) {
+    threads.emplace_back([&] {
+      CatCommand catCommand(vfs);
+      StatCommand statCommand(vfs);
+      ListDirectoryCommand listCommand(vfs);
+      while (writing) {
+        bool isDirectory = false;
+        if (catCommand.execute({"/hello"}) != "Hello, world!" ||
+            statCommand.execute({"/hello"}).find("Size: 13") ==
+                std::string::npos ||
+            listCommand.execute({"/dir"}).find("file") == std::string::npos ||
+            vfs->normalizePath("/dir/../dir/./file", isDirectory) !=
+                "/dir/file" ||
+            vfs->completePath("/he").size() != 1) {
+          ++readerFailures;
+        }
+        // Removed while being looked at.
+        std::string removed = statCommand.execute({"/copy0_1"});
+        if (removed.find("Size: 13") == std::string::npos &&
+            removed.find("No such file") == std::string::npos) {
+          ++readerFailures;
+        }
+      }
+    });
+  }
+  std::thread compactor([&] {
+    while (writing) {
+      vfs->compact();
+    }
+  });
+
+  std::vector<std::thread> writers;
+  for (int writer = 0; writer < kWriters; ++writer) {
+    writers.emplace_back([&, writer] {
+      CpCommand cpCommand(vfs);
+      RemoveCommand removeCommand(vfs);
+      for (int i = 0; i < kCopies; ++i) {
+        std::string copy =
+            "/copy" + std::to_string(writer) + "_" + std::to_string(i);
+        cpCommand.execute({"/hello", copy});
+        if (i % 2 == 1) {
+          removeCommand.execute({copy});
+        }
+      }
+    });
+  }
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  writing = false;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  compactor.join();
+  EXPECT_EQ(readerFailures, 0);
+
+  auto check = [&](const std::shared_ptr<VirtualFilesystem> &mounted) {
+    CatCommand catCommand(mounted);
+    for (int writer = 0; writer < kWriters; ++writer) {
+      for (int i = 0; i < kCopies; ++i) {
+        std::string copy =
+            "/copy" + std::to_string(writer) + "_" + std::to_string(i);
+        EXPECT_EQ(mounted->existsInStorage(copy), i % 2 == 0) << copy;
+        if (i % 2 == 0) {
+          EXPECT_EQ(catCommand.execute({copy}), "Hello, world!") << copy;
+        }
+      }
+    }
+  };
+  check(vfs);
+  vfs.reset();
+  check(std::make_shared<VirtualFilesystem>(archivePath));
+}
+
+TEST_F(VirtualFilesystemTest, TestMountCanonicalizesArchivePaths) {
+  std::string imagePath = "relative.tar";
+  writeTestArchive(imagePath, {"rel/", "rel/./x", "/rel/../../y", "./",
+                               "z -> rel//x"});
+  {
+    auto mounted = std::make_shared<VirtualFilesystem>(imagePath);
+    CatCommand catCommand(mounted);
+    EXPECT_EQ(catCommand.execute({"/rel/x"}), "rel/./x");
+    EXPECT_EQ(catCommand.execute({"/y"}), "/rel/../../y");
+    EXPECT_EQ(catCommand.execute({"/z"}), "rel/./x");
+    mounted->compact();
+    EXPECT_EQ(catCommand.execute({"/rel/x", "/y", "/z"}),
+              "rel/./x/rel/../../yrel/./x");
+  }
+  boost::filesystem::remove(imagePath);
+}
+
+TEST_F(VirtualFilesystemTest, TestRefreshMergesAppendedEntries) {
+  std::string imagePath = "growing.tar";
+  std::vector<std::string> files = {"a/", "a/x", "y"};
+  for (int i = 0; i < 2000; ++i) {
+    files.push_back("a/f" + std::to_string(i));
+  }
+  writeTestArchive(imagePath, files);
+  {
+    auto mounted = std::make_shared<VirtualFilesystem>(imagePath);
+    CatCommand catCommand(mounted);
+    EXPECT_EQ(catCommand.execute({"/y"}), "y");
+    EXPECT_EQ(mounted->refresh(), 0u);
+
+    appendTestArchive(imagePath, {"a/z", "b/", "b/w", "y", "l -> a/z", "a/"});
+    uint64_t bytesBefore = instrumentation::archiveBytesRead.load();
+    EXPECT_EQ(mounted->refresh(), 5u);
+    // Only the tail is read, not the thousands of entries before it.
+    EXPECT_LT(instrumentation::archiveBytesRead.load() - bytesBefore,
+              boost::filesystem::file_size(imagePath) / 4);
+    EXPECT_EQ(mounted->refresh(), 0u);
+
+    std::string errorMessage;
+    EXPECT_EQ(mounted->listDirectory("/b", errorMessage),
+              std::vector<std::string>{"w"});
+    EXPECT_EQ(mounted->listDirectory("/a", errorMessage).size(), 2002u);
+    EXPECT_EQ(catCommand.execute({"/a/z", "/b/w", "/y", "/l", "/a/x"}),
+              "a/zb/wya/za/x");
+
+    // Folding pending changes at shutdown merges a fresh tail first
+    // instead of overwriting it.
+    CpCommand cpCommand(mounted);
+    cpCommand.execute({"/y", "/copy"});
+    appendTestArchive(imagePath, {"c"});
+  }
+  {
+    auto remounted = std::make_shared<VirtualFilesystem>(imagePath);
+    CatCommand catCommand(remounted);
+    EXPECT_EQ(catCommand.execute({"/a/z", "/y", "/l", "/copy", "/c"}),
+              "a/zya/zyc");
+  }
+  boost::filesystem::remove(imagePath);
+}
+
+#ifdef __linux__
+TEST_F(VirtualFilesystemTest, TestWatchArchivePicksUpAppends) {
+  std::string imagePath = "watched.tar";
+  writeTestArchive(imagePath, {"x"});
+  {
+    auto mounted = std::make_shared<VirtualFilesystem>(imagePath);
+    std::atomic<size_t> merged{0};
+    mounted->watchArchive([&](size_t count) { merged += count; });
+    // Our own appends do not count as changes.
+    mounted->addFileToArchiveAndStorage("/own", 0, FileType::REG);
+    mounted->compact();
+
+    appendTestArchive(imagePath, {"y", "z"});
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (merged < 2 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(merged, 2u);
+    EXPECT_TRUE(mounted->existsInStorage("/y"));
+    EXPECT_TRUE(mounted->existsInStorage("/z"));
+    mounted->watchArchive(nullptr);
+  }
+  boost::filesystem::remove(imagePath);
+}
+
+TEST_F(VirtualFilesystemTest, TestWatcherReportsDespiteNeighbourWrites) {
+  std::string watchedPath = "watched.txt";
+  std::string neighbourPath = "neighbour.txt";
+  std::ofstream(watchedPath) << "a";
+  std::atomic<int> changes{0};
+  {
+    FileWatcher watcher(watchedPath, [&] { ++changes; });
+    std::ofstream(watchedPath, std::ios::app) << "b";
+    // Writes to another file in the directory, well within the coalescing
+    // window of each other, must not postpone the report.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (changes == 0 && std::chrono::steady_clock::now() < deadline) {
+      std::ofstream(neighbourPath, std::ios::app) << "x";
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_EQ(changes, 1);
+  }
+  boost::filesystem::remove(watchedPath);
+  boost::filesystem::remove(neighbourPath);
+}
+#endif